@@ -5,92 +5,95 @@
 #include <time.h>
 
 #define MAX_WORD_LEN 100
-#define HASH_SIZE 10007
-#define MAX_WORDS 10000000
 
-typedef struct Word
-{
-    char word[MAX_WORD_LEN];
-    int count;
-    struct Word *next;
-} Word;
+#include "../common/doc_matrix.h"
+#include "../common/file_map.h"
+#include "../common/options.h"
+#include "../common/stats.h"
+#include "../common/word_table.h"
 
-Word *global_hash_table[HASH_SIZE];
+WordTable global_table;
+NgramCounter global_ngrams;
 
-// Hash function
-int hash(char *word)
+// Count every word of the input with the fused scan kernel
+long long count_words(const Options *opts)
 {
-    int h = 0;
-    for (int i = 0; word[i]; i++)
-        h = (h * 31 + word[i]) % HASH_SIZE;
-    return h;
+    const char *data;
+    size_t size;
+    if (map_input(opts->input, &data, &size) != 0)
+        return -1;
+
+    long long count = word_table_scan(&global_table, data, size, 0, size, TOKEN_SPLIT_SPACE, opts->utf8);
+
+    unmap_input(data, size);
+    return count;
 }
 
-// Insert into global hash table
-void insert_word(char *word)
+// Count every document of the input into one row buffer and write the
+// term-document matrix
+long long count_documents(const Options *opts)
 {
-    int index = hash(word);
-    Word *entry = global_hash_table[index];
+    DocRows rows;
+    doc_rows_init(&rows, &opts->docs, opts->utf8);
 
-    while (entry)
+    long long docs = -1;
+    if (opts->docs.mode == DOCS_FILE)
     {
-        if (strcmp(entry->word, word) == 0)
-        {
-            entry->count++;
-            return;
-        }
-        entry = entry->next;
+        char **paths;
+        size_t n;
+        if (doc_read_list(opts->input, &paths, &n) != 0)
+            goto cleanup;
+        for (size_t i = 0; i < n; i++)
+            doc_rows_add_file(&rows, paths[i], i);
+        doc_free_list(paths, n);
     }
+    else
+    {
+        const char *data;
+        size_t size;
+        if (map_input(opts->input, &data, &size) != 0)
+            goto cleanup;
+        doc_rows_begin_part(&rows, 0, size > 0);
+        doc_rows_scan(&rows, data, size, 0, size, 1, 0);
+        doc_rows_end_part(&rows);
+        unmap_input(data, size);
+    }
+
+    DocMatrixHeader h;
+    if (doc_matrix_save(opts->matrix, &rows, 1, &h) != 0)
+        goto cleanup;
+    printf("Wrote %llu documents, %llu terms and %llu entries to %s\n", (unsigned long long)h.docs,
+           (unsigned long long)h.terms, (unsigned long long)h.entries, opts->matrix);
+    docs = (long long)h.docs;
 
-    Word *new_word = (Word *)malloc(sizeof(Word));
-    strcpy(new_word->word, word);
-    new_word->count = 1;
-    new_word->next = global_hash_table[index];
-    global_hash_table[index] = new_word;
+cleanup:
+    doc_rows_free(&rows);
+    return docs;
 }
 
-// Lowercase, remove punctuation
-void clean_word(char *word)
+void push_ngram_word(void *ctx, char *word)
 {
-    int j = 0;
-    for (int i = 0; word[i]; i++)
-    {
-        if (isalpha(word[i]))
-        {
-            word[j++] = tolower(word[i]);
-        }
-    }
-    word[j] = '\0';
+    ngram_push(&global_ngrams, word);
+    (*(long long *)ctx)++;
 }
 
-// Load all words into array
-int load_words_and_insert(char *filename)
+// Count the n-grams of every word of the input, split as in count_words()
+long long load_ngrams(const Options *opts)
 {
-    FILE *file = fopen(filename, "r");
-    if (!file)
-    {
-        perror("File open failed");
+    const char *data;
+    size_t size;
+    if (map_input(opts->input, &data, &size) != 0)
         return -1;
-    }
 
-    int count = 0;
-    char buffer[MAX_WORD_LEN];
-    while (fscanf(file, "%s", buffer) != EOF && count < MAX_WORDS)
-    {
-        clean_word(buffer);
-        if (strlen(buffer) > 0)
-        {
-            insert_word(buffer);
-            count++;
-        }
-    }
+    long long count = 0;
+    scan_space_tokens(opts->utf8, data, size, push_ngram_word, &count);
 
-    fclose(file);
+    unmap_input(data, size);
     return count;
 }
 
 // Save final global hash table
-void save_results()
+void save_results(int ngram, int sort)
 {
     FILE *fp = fopen("word_counts_serial.txt", "w");
     if (!fp)
@@ -99,14 +102,23 @@ void save_results()
         return;
     }
 
-    for (int i = 0; i < HASH_SIZE; i++)
+    // Sorted output goes through the word table, so n-grams sort like words
+    if (sort != SORT_NONE)
+    {
+        if (ngram > 1)
+            ngram_counter_to_table(&global_ngrams, &global_table);
+        write_sorted_results(fp, &global_table, sort);
+        fclose(fp);
+        return;
+    }
+
+    if (ngram > 1)
+        ngram_write_results(fp, &global_ngrams);
+
+    for (size_t i = 0; i < global_table.used; i++)
     {
-        Word *entry = global_hash_table[i];
-        while (entry)
-        {
-            fprintf(fp, "%s: %d\n", entry->word, entry->count);
-            entry = entry->next;
-        }
+        WordEntry *entry = word_table_entry(&global_table, i);
+        fprintf(fp, "%s: %lld\n", entry->word, entry->count);
     }
 
     fclose(fp);
@@ -114,15 +126,34 @@ void save_results()
 
 int main(int argc, char *argv[])
 {
-    if (argc < 2)
+    Options opts;
+    if (parse_options(argc, argv, &opts) != 0)
     {
-        printf("Usage: %s input.txt\n", argv[0]);
+        printf("Usage: %s " OPTIONS_USAGE "\n", argv[0]);
         return 1;
     }
 
+    RunStats run_stats;
+    stats_start(&run_stats, opts.stats != NULL, opts.stats_interval);
+
+    word_table_init(&global_table);
+    if (opts.ngram > 1)
+        ngram_counter_init(&global_ngrams, opts.ngram);
+
     double start_time = (double)clock() / CLOCKS_PER_SEC;
 
-    int total_words = load_words_and_insert(argv[1]);
+    if (opts.docs.mode != DOCS_NONE)
+    {
+        long long docs = count_documents(&opts);
+        if (docs < 0)
+            return 1;
+        printf("Document count complete. Time taken: %.4f seconds\n",
+               (double)clock() / CLOCKS_PER_SEC - start_time);
+        stats_write(&run_stats, "serial", opts.stats);
+        return 0;
+    }
+
+    long long total_words = opts.ngram > 1 ? load_ngrams(&opts) : count_words(&opts);
     if (total_words < 0)
         return 1;
 
@@ -130,16 +161,19 @@ int main(int argc, char *argv[])
     double duration = end_time - start_time;
 
     printf("Word count complete. Time taken: %.4f seconds\n", duration);
-    printf("Total words processed: %d\n", total_words);
+    printf("Total words processed: %lld\n", total_words);
 
-    save_results();
+    if (opts.ngram == 1)
+        stats_add_table(&run_stats, "global", &global_table);
+    save_results(opts.ngram, opts.sort);
+    stats_write(&run_stats, "serial", opts.stats);
 
     // Log performance
     FILE *log = fopen("performance_log_serial.txt", "w");
     if (log)
     {
         fprintf(log, "Execution time: %.4f seconds\n", duration);
-        fprintf(log, "Total words processed: %d\n", total_words);
+        fprintf(log, "Total words processed: %lld\n", total_words);
         fclose(log);
     }
     else
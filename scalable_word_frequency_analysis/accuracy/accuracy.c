@@ -15,7 +15,7 @@ typedef struct Word {
 int hash(const char *word) {
     int h = 0;
     for (int i = 0; word[i]; i++) {
-        h = (h * 31 + word[i]) % HASH_SIZE;
+        h = (h * 31 + (unsigned char)word[i]) % HASH_SIZE;
     }
     return h;
 }
@@ -0,0 +1,483 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sched.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#else
+#define HAVE_TSC 0
+#endif
+
+#define MAX_WORD_LEN 100
+#define CORPUS_BYTES (8 * 1024 * 1024)
+#define MIN_SAMPLE_NS 20e6
+#define DEFAULT_REPS 10
+#define DEFAULT_THRESHOLD 10.0
+#define MAX_BASELINE 64
+
+#include "../common/tokenize.h"
+#include "../common/word_table.h"
+
+// Microbenchmarks for the counting kernels. Every kernel runs over the same
+// generated corpora (at least CORPUS_BYTES of Zipf-distributed words drawn
+// from a small, a medium and a large vocabulary, with every vocabulary word
+// present), single-threaded and pinned to one CPU, so numbers from two
+// builds of the same machine can be compared. A kernel is repeated within
+// each timed sample until the sample lasts MIN_SAMPLE_NS. The results can be
+// saved as a baseline and later runs checked against it.
+
+static const size_t vocab_sizes[] = {1000, 100000, 1000000};
+#define NVOCABS (sizeof(vocab_sizes) / sizeof(vocab_sizes[0]))
+
+typedef struct {
+    size_t vocab;
+    char *text;             // the corpus as the engines read it
+    size_t len;
+    char *pool;             // vocabulary, lowercased and NUL separated
+    const char **word;      // the corpus words in order, pointing into pool
+    uint32_t *word_len;
+    size_t nwords;
+    size_t word_bytes;      // sum of word_len
+} Corpus;
+
+typedef struct {
+    double ns;
+    double cycles;
+    long long ops;
+    size_t bytes;
+} Run;
+
+// Runs the kernel iters times, adding each timed pass to run
+typedef void (*Kernel)(const Corpus *c, int iters, Run *run);
+
+typedef struct {
+    struct timespec ts;
+    unsigned long long tsc;
+} Stamp;
+
+static Stamp stamp(void) {
+    Stamp s;
+#if HAVE_TSC
+    s.tsc = __rdtsc();
+#else
+    s.tsc = 0;
+#endif
+    clock_gettime(CLOCK_MONOTONIC, &s.ts);
+    return s;
+}
+
+static void elapsed(Stamp a, Stamp b, Run *run) {
+    run->ns += (b.ts.tv_sec - a.ts.tv_sec) * 1e9 + (b.ts.tv_nsec - a.ts.tv_nsec);
+    run->cycles += (double)(b.tsc - a.tsc);
+}
+
+static uint64_t rng_next(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+// The same vocabulary and word sequence on every run and every machine.
+// The vocabulary words are distinct, and the words the Zipf draws miss are
+// added once each and shuffled in, so the corpus has exactly vocab distinct
+// words.
+static void corpus_build(Corpus *c, size_t vocab) {
+    memset(c, 0, sizeof(*c));
+    c->vocab = vocab;
+    uint64_t rng = 0x9e3779b97f4a7c15ull ^ vocab;
+
+    c->pool = malloc(vocab * 13);
+    const char **vocab_word = malloc(vocab * sizeof(char *));
+    uint32_t *vocab_len = malloc(vocab * sizeof(uint32_t));
+    double *cdf = malloc(vocab * sizeof(double));
+    WordTable seen;
+    word_table_init(&seen);
+    char *p = c->pool;
+    double total = 0;
+    for (size_t r = 0; r < vocab; r++) {
+        uint32_t len;
+        do {
+            len = 2 + rng_next(&rng) % 11;
+            for (uint32_t i = 0; i < len; i++)
+                p[i] = 'a' + rng_next(&rng) % 26;
+        } while (word_table_find(&seen, p, len, word_hash(p, len)) >= 0);
+        word_table_add_hashed(&seen, p, len, word_hash(p, len), 1);
+        vocab_word[r] = p;
+        vocab_len[r] = len;
+        p += len;
+        *p++ = '\0';
+        total += 1.0 / (r + 1);
+        cdf[r] = total;
+    }
+    word_table_free(&seen);
+
+    // Draw ranks until the words fill CORPUS_BYTES, then add the missed ones
+    size_t cap = CORPUS_BYTES / 4, n = 0, bytes = 0;
+    uint32_t *rank = malloc(cap * sizeof(uint32_t));
+    char *drawn = calloc(vocab, 1);
+    while (bytes < CORPUS_BYTES) {
+        double u = (rng_next(&rng) >> 11) * (1.0 / 9007199254740992.0) * total;
+        size_t lo = 0, hi = vocab - 1;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (cdf[mid] < u)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (n == cap) {
+            cap *= 2;
+            rank = realloc(rank, cap * sizeof(uint32_t));
+        }
+        rank[n++] = (uint32_t)lo;
+        drawn[lo] = 1;
+        bytes += vocab_len[lo] + 1;
+    }
+    for (size_t r = 0; r < vocab; r++) {
+        if (drawn[r])
+            continue;
+        if (n == cap) {
+            cap *= 2;
+            rank = realloc(rank, cap * sizeof(uint32_t));
+        }
+        rank[n++] = (uint32_t)r;
+        bytes += vocab_len[r] + 1;
+    }
+    for (size_t i = n - 1; i > 0; i--) {
+        size_t j = rng_next(&rng) % (i + 1);
+        uint32_t t = rank[i];
+        rank[i] = rank[j];
+        rank[j] = t;
+    }
+
+    c->nwords = n;
+    c->word = malloc(n * sizeof(char *));
+    c->word_len = malloc(n * sizeof(uint32_t));
+    c->text = malloc(2 * bytes + 1);
+    for (size_t i = 0; i < n; i++) {
+        uint32_t r = rank[i];
+        c->word[i] = vocab_word[r];
+        c->word_len[i] = vocab_len[r];
+        c->word_bytes += vocab_len[r];
+
+        // Some capitals and punctuation, so case folding and delimiters are exercised
+        uint64_t mark = rng_next(&rng);
+        memcpy(c->text + c->len, vocab_word[r], vocab_len[r]);
+        if (mark % 8 == 0)
+            c->text[c->len] -= 'a' - 'A';
+        c->len += vocab_len[r];
+        if (mark % 16 == 1)
+            c->text[c->len++] = ',';
+        c->text[c->len++] = mark % 12 == 2 ? '\n' : ' ';
+    }
+    c->text[c->len] = '\0';
+    free(rank);
+    free(drawn);
+    free(vocab_word);
+    free(vocab_len);
+    free(cdf);
+}
+
+static void corpus_free(Corpus *c) {
+    free(c->text);
+    free(c->pool);
+    free(c->word);
+    free(c->word_len);
+}
+
+static void count_table(WordTable *t, const Corpus *c, size_t from, size_t to) {
+    word_table_init(t);
+    for (size_t i = from; i < to; i++)
+        word_table_add_hashed(t, c->word[i], c->word_len[i], word_hash(c->word[i], c->word_len[i]), 1);
+}
+
+static volatile uint64_t sink;
+
+static void bench_hash(const Corpus *c, int iters, Run *run) {
+    for (int it = 0; it < iters; it++) {
+        uint64_t h = 0;
+        Stamp a = stamp();
+        for (size_t i = 0; i < c->nwords; i++)
+            h ^= word_hash(c->word[i], c->word_len[i]);
+        Stamp b = stamp();
+        sink = h;
+        elapsed(a, b, run);
+        run->ops += (long long)c->nwords;
+        run->bytes += c->word_bytes;
+    }
+}
+
+static void count_emitted(void *ctx, char *word) {
+    (void)word;
+    (*(long long *)ctx)++;
+}
+
+// The standalone tokenizer, which copies and lowercases each word into a
+// buffer and hands it to a callback; the MPI n-gram and document paths use
+// it, while word counting fuses this step into word_table_scan().
+static void bench_tokenize(const Corpus *c, int iters, Run *run) {
+    for (int it = 0; it < iters; it++) {
+        long long words = 0;
+        Stamp a = stamp();
+        scan_range(0, c->text, c->len, 0, c->len, count_emitted, &words);
+        Stamp b = stamp();
+        elapsed(a, b, run);
+        run->ops += words;
+        run->bytes += c->len;
+    }
+}
+
+// The fused tokenize, hash and insert kernel every engine counts with.
+static void bench_scan(const Corpus *c, int iters, Run *run) {
+    for (int it = 0; it < iters; it++) {
+        WordTable t;
+        word_table_init(&t);
+        Stamp a = stamp();
+        long long words = word_table_scan(&t, c->text, c->len, 0, c->len, TOKEN_SPLIT_NONLETTER, 0);
+        Stamp b = stamp();
+        word_table_free(&t);
+        elapsed(a, b, run);
+        run->ops += words;
+        run->bytes += c->len;
+    }
+}
+
+static void bench_insert(const Corpus *c, int iters, Run *run) {
+    for (int it = 0; it < iters; it++) {
+        WordTable t;
+        word_table_init(&t);
+        Stamp a = stamp();
+        for (size_t i = 0; i < c->nwords; i++)
+            word_table_add(&t, c->word[i], 1);
+        Stamp b = stamp();
+        word_table_free(&t);
+        elapsed(a, b, run);
+        run->ops += (long long)c->nwords;
+        run->bytes += c->word_bytes;
+    }
+}
+
+// Two thread tables, each counted from half of the corpus, merged into one.
+// The half tables are counted once; every pass merges into a fresh copy of
+// the first.
+static void bench_merge(const Corpus *c, int iters, Run *run) {
+    WordTable first, src;
+    count_table(&first, c, 0, c->nwords / 2);
+    count_table(&src, c, c->nwords / 2, c->nwords);
+    size_t src_bytes = 0;
+    for (size_t i = 0; i < src.used; i++)
+        src_bytes += word_table_entry(&src, i)->len;
+    for (int it = 0; it < iters; it++) {
+        WordTable dst;
+        word_table_init(&dst);
+        word_table_merge(&dst, &first);
+        Stamp a = stamp();
+        word_table_merge(&dst, &src);
+        Stamp b = stamp();
+        word_table_free(&dst);
+        elapsed(a, b, run);
+        run->ops += (long long)src.used;
+        run->bytes += src_bytes;
+    }
+    word_table_free(&first);
+    word_table_free(&src);
+}
+
+// Packing a table for the gather to rank 0 in the MPI builds.
+static void bench_flatten(const Corpus *c, int iters, Run *run) {
+    WordTable t;
+    count_table(&t, c, 0, c->nwords);
+    for (int it = 0; it < iters; it++) {
+        char *words;
+        size_t bytes;
+        long long *counts;
+        Stamp a = stamp();
+        long long n = flatten_table(&t, &words, &bytes, &counts);
+        Stamp b = stamp();
+        free(words);
+        free(counts);
+        elapsed(a, b, run);
+        run->ops += n;
+        run->bytes += bytes;
+    }
+    word_table_free(&t);
+}
+
+static const struct {
+    const char *name;
+    Kernel fn;
+} kernels[] = {
+    {"hash", bench_hash},
+    {"tokenize", bench_tokenize},
+    {"scan", bench_scan},
+    {"insert", bench_insert},
+    {"merge", bench_merge},
+    {"flatten", bench_flatten},
+};
+#define NKERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+typedef struct {
+    char name[32];
+    size_t vocab;
+    double ns_per_op;
+} Baseline;
+
+static int load_baseline(const char *filename, Baseline *b, int max) {
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+        perror("Failed to open baseline file");
+        return -1;
+    }
+    char line[256];
+    int n = 0;
+    while (n < max && fgets(line, sizeof(line), f)) {
+        if (line[0] == '#')
+            continue;
+        if (sscanf(line, "%31s %zu %lf", b[n].name, &b[n].vocab, &b[n].ns_per_op) == 3)
+            n++;
+    }
+    fclose(f);
+    return n;
+}
+
+static const Baseline *find_baseline(const Baseline *b, int n, const char *name, size_t vocab) {
+    for (int i = 0; i < n; i++) {
+        if (strcmp(b[i].name, name) == 0 && b[i].vocab == vocab)
+            return &b[i];
+    }
+    return NULL;
+}
+
+// Pin to the given CPU, or to the first one this process may run on.
+static int pin_cpu(int cpu) {
+    cpu_set_t set;
+    if (cpu < 0) {
+        if (sched_getaffinity(0, sizeof(set), &set) != 0)
+            return -1;
+        for (cpu = 0; cpu < CPU_SETSIZE && !CPU_ISSET(cpu, &set); cpu++)
+            ;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        perror("Failed to pin to CPU");
+        return -1;
+    }
+    return cpu;
+}
+
+#define BENCH_USAGE                                                                      \
+    "[--reps N] [--cpu N] [--kernel NAME] [--baseline FILE] [--save-baseline FILE]\n" \
+    "       [--threshold PERCENT]"
+
+int main(int argc, char *argv[]) {
+    int reps = DEFAULT_REPS, cpu = -1;
+    double threshold = DEFAULT_THRESHOLD;
+    const char *only = NULL, *baseline_file = NULL, *save_file = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc)
+            reps = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--cpu") == 0 && i + 1 < argc)
+            cpu = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--kernel") == 0 && i + 1 < argc)
+            only = argv[++i];
+        else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc)
+            baseline_file = argv[++i];
+        else if (strcmp(argv[i], "--save-baseline") == 0 && i + 1 < argc)
+            save_file = argv[++i];
+        else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc)
+            threshold = atof(argv[++i]);
+        else {
+            printf("Usage: %s " BENCH_USAGE "\n", argv[0]);
+            return 1;
+        }
+    }
+    if (reps < 2) {
+        fprintf(stderr, "Error: --reps must be at least 2\n");
+        return 1;
+    }
+
+    Baseline baseline[MAX_BASELINE];
+    int nbaseline = 0;
+    if (baseline_file && (nbaseline = load_baseline(baseline_file, baseline, MAX_BASELINE)) < 0)
+        return 1;
+    FILE *save = NULL;
+    if (save_file) {
+        save = fopen(save_file, "w");
+        if (!save) {
+            perror("Failed to open baseline file for writing");
+            return 1;
+        }
+        fprintf(save, "# kernel vocab ns/op cycles/byte\n");
+    }
+
+    cpu = pin_cpu(cpu);
+    if (cpu >= 0)
+        printf("Pinned to CPU %d, %d repetitions of at least %.0f ms, %d MB corpora or more\n", cpu, reps,
+               MIN_SAMPLE_NS / 1e6, CORPUS_BYTES >> 20);
+    if (!HAVE_TSC)
+        printf("No time stamp counter on this CPU; cycles/byte is not reported\n");
+    printf("%-9s %8s %10s %10s %8s %12s %10s\n", "kernel", "vocab", "ops", "ns/op", "+/-%", "cycles/byte", "vs base");
+
+    Run *runs = malloc(reps * sizeof(Run));
+    int regressions = 0;
+    for (size_t v = 0; v < NVOCABS; v++) {
+        Corpus c;
+        corpus_build(&c, vocab_sizes[v]);
+        for (size_t k = 0; k < NKERNELS; k++) {
+            if (only && strcmp(only, kernels[k].name) != 0)
+                continue;
+
+            // The warm-up pass also sets how many passes make up a sample
+            Run warmup = {0};
+            kernels[k].fn(&c, 1, &warmup);
+            int iters = warmup.ns < MIN_SAMPLE_NS ? (int)(MIN_SAMPLE_NS / (warmup.ns > 1 ? warmup.ns : 1)) + 1 : 1;
+            double sum = 0, sum_sq = 0, cycles = 0;
+            for (int r = 0; r < reps; r++) {
+                runs[r] = (Run){0};
+                kernels[k].fn(&c, iters, &runs[r]);
+                double ns_per_op = runs[r].ns / (runs[r].ops ? runs[r].ops : 1);
+                sum += ns_per_op;
+                sum_sq += ns_per_op * ns_per_op;
+                cycles += runs[r].cycles / (runs[r].bytes ? runs[r].bytes : 1);
+            }
+            double mean = sum / reps;
+            double var = (sum_sq - sum * sum / reps) / (reps - 1);
+            double rsd = mean > 0 ? 100.0 * sqrt(var > 0 ? var : 0) / mean : 0;
+            cycles /= reps;
+
+            char versus[32] = "-";
+            const Baseline *b = find_baseline(baseline, nbaseline, kernels[k].name, c.vocab);
+            if (b && b->ns_per_op > 0) {
+                double change = 100.0 * (mean - b->ns_per_op) / b->ns_per_op;
+                int regressed = change > threshold;
+                snprintf(versus, sizeof(versus), "%+.1f%%%s", change, regressed ? " SLOWER" : "");
+                regressions += regressed;
+            }
+            printf("%-9s %8zu %10lld %10.2f %8.1f %12.2f %10s\n", kernels[k].name, c.vocab, runs[0].ops / iters, mean, rsd,
+                   HAVE_TSC ? cycles : 0.0, versus);
+            fflush(stdout);
+            if (save)
+                fprintf(save, "%s %zu %.4f %.4f\n", kernels[k].name, c.vocab, mean, HAVE_TSC ? cycles : 0.0);
+        }
+        corpus_free(&c);
+    }
+    free(runs);
+    if (save)
+        fclose(save);
+
+    if (baseline_file) {
+        if (regressions)
+            printf("%d kernel(s) more than %.1f%% slower than %s\n", regressions, threshold, baseline_file);
+        else
+            printf("No kernel more than %.1f%% slower than %s\n", threshold, baseline_file);
+    }
+    return regressions ? 2 : 0;
+}
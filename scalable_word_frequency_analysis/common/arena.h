@@ -0,0 +1,65 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdlib.h>
+#include <string.h>
+
+// Bump allocator: many small allocations carved out of a few large blocks,
+// all released together. Each table (and so each thread) owns its arenas,
+// so threads never contend on malloc while counting.
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used, cap;
+    char data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock *blocks;     // newest first
+    size_t reserved;        // bytes obtained from malloc
+} Arena;
+
+void arena_init(Arena *a) {
+    a->blocks = NULL;
+    a->reserved = 0;
+}
+
+void *arena_alloc(Arena *a, size_t size) {
+    ArenaBlock *b = a->blocks;
+    if (!b || b->cap - b->used < size) {
+        size_t cap = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        b = malloc(sizeof(ArenaBlock) + cap);
+        if (!b)
+            return NULL;
+        b->used = 0;
+        b->cap = cap;
+        b->next = a->blocks;
+        a->blocks = b;
+        a->reserved += sizeof(ArenaBlock) + cap;
+    }
+    void *p = b->data + b->used;
+    b->used += size;
+    return p;
+}
+
+// Copy len bytes plus a terminating NUL into the arena.
+char *arena_strdup(Arena *a, const char *s, size_t len) {
+    char *p = arena_alloc(a, len + 1);
+    memcpy(p, s, len);
+    p[len] = '\0';
+    return p;
+}
+
+void arena_release(Arena *a) {
+    ArenaBlock *b = a->blocks;
+    while (b) {
+        ArenaBlock *next = b->next;
+        free(b);
+        b = next;
+    }
+    a->blocks = NULL;
+    a->reserved = 0;
+}
+
+#endif
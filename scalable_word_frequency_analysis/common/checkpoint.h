@@ -0,0 +1,416 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mpi.h>
+
+#include "chunk_queue.h"
+#include "window_io.h"
+#include "word_table.h"
+
+// Checkpoints of a word count in progress. Every rank writes its own file on
+// its own schedule: the words it has counted so far and the byte ranges of
+// the input they came from. A word belongs to the range holding its first
+// byte, so the counts of any set of ranges are well defined, each file is
+// consistent by itself, and the files of one run never overlap. A restarted
+// run, with any number of ranks, loads the files, counts only the ranges none
+// of them covers, and adds the loaded counts in.
+//
+// PREFIX.<run>.<rank> holds a rank's checkpoint and PREFIX is a manifest
+// naming the run whose files are current. A file is replaced by writing
+// PREFIX.<run>.<rank>.tmp and renaming it over the old one. A restarted run
+// first writes a complete set of files under the next run number, then points
+// the manifest at them and deletes the old set, so a crash at any moment
+// leaves exactly one complete set.
+//
+// File layout, native byte order: a CheckpointHeader, the ranges as
+// int64 (begin, end) pairs, the counts as int64, then the words, each
+// NUL-terminated, in the same order as the counts.
+
+#define CHECKPOINT_MAGIC "WCCKPT01"
+#define CHECKPOINT_MANIFEST_MAGIC "WCMANI01"
+
+typedef struct {
+    char magic[8];
+    uint32_t rank;
+    uint32_t ranks;
+    uint64_t run;
+    uint64_t input_size;
+    uint64_t ranges;
+    uint64_t words;
+    uint64_t text_bytes;
+} CheckpointHeader;
+
+typedef struct {
+    char magic[8];
+    uint32_t ranks;     // files PREFIX.<run>.0 to PREFIX.<run>.<ranks - 1>
+    uint32_t reserved;
+    uint64_t run;
+    uint64_t input_size;
+} CheckpointManifest;
+
+typedef struct {
+    const char *prefix;     // NULL when checkpoints are off
+    double interval;        // seconds between a rank's checkpoints
+    double last;            // MPI_Wtime() of this rank's last checkpoint
+    uint64_t run;
+    MPI_Offset input_size;
+    ByteRange *done;        // ranges counted into this rank's tables
+    size_t ndone, cap;
+    long long written;
+    long long bytes;
+    double seconds;
+} Checkpoint;
+
+static void checkpoint_path(char *buf, size_t n, const char *prefix, uint64_t run, int rank, int tmp) {
+    snprintf(buf, n, "%s.%llu.%d%s", prefix, (unsigned long long)run, rank, tmp ? ".tmp" : "");
+}
+
+// Record that [begin, end) has been counted into this rank's tables.
+void checkpoint_done(Checkpoint *c, MPI_Offset begin, MPI_Offset end) {
+    if (!c->prefix || begin >= end)
+        return;
+    if (c->ndone && c->done[c->ndone - 1].end == begin) {
+        c->done[c->ndone - 1].end = end;
+        return;
+    }
+    if (c->ndone == c->cap) {
+        c->cap = c->cap ? 2 * c->cap : 64;
+        c->done = realloc(c->done, c->cap * sizeof(ByteRange));
+    }
+    c->done[c->ndone++] = (ByteRange){begin, end};
+}
+
+static int checkpoint_write_at(MPI_File file, MPI_Offset offset, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        int piece = len > MAX_MSG_BYTES ? MAX_MSG_BYTES : (int)len;
+        if (MPI_File_write_at(file, offset, p, piece, MPI_BYTE, MPI_STATUS_IGNORE) != MPI_SUCCESS)
+            return -1;
+        p += piece;
+        offset += piece;
+        len -= piece;
+    }
+    return 0;
+}
+
+static int checkpoint_read_at(MPI_File file, MPI_Offset offset, void *data, size_t len) {
+    char *p = data;
+    while (len > 0) {
+        int piece = len > MAX_MSG_BYTES ? MAX_MSG_BYTES : (int)len, got = 0;
+        MPI_Status status;
+        if (MPI_File_read_at(file, offset, p, piece, MPI_BYTE, &status) != MPI_SUCCESS)
+            return -1;
+        MPI_Get_count(&status, MPI_BYTE, &got);
+        if (got != piece)
+            return -1;
+        p += piece;
+        offset += piece;
+        len -= piece;
+    }
+    return 0;
+}
+
+// Write data to path through a temporary file, synced before it is renamed
+// over path, so path always holds either the old contents or the new.
+static int checkpoint_replace(const char *path, const char *tmp, const void *data, size_t len) {
+    MPI_File file;
+    if (MPI_File_open(MPI_COMM_SELF, tmp, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &file) != MPI_SUCCESS)
+        return -1;
+    MPI_File_set_size(file, 0);
+    int rc = checkpoint_write_at(file, 0, data, len);
+    if (rc == 0 && MPI_File_sync(file) != MPI_SUCCESS)
+        rc = -1;
+    MPI_File_close(&file);
+    if (rc == 0 && rename(tmp, path) != 0)
+        rc = -1;
+    return rc;
+}
+
+// Write this rank's checkpoint: its ranges and the words of every table.
+// Words found in several tables are written once per table; loading adds
+// them up again.
+int checkpoint_write(Checkpoint *c, const WordTable *tables, int ntables) {
+    int rank, size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+    double start = MPI_Wtime();
+
+    char **words = malloc(ntables * sizeof(char *));
+    long long **counts = malloc(ntables * sizeof(long long *));
+    long long *n = malloc(ntables * sizeof(long long));
+    size_t *text = malloc(ntables * sizeof(size_t));
+    CheckpointHeader h = {.rank = (uint32_t)rank, .ranks = (uint32_t)size, .run = c->run,
+                          .input_size = (uint64_t)c->input_size, .ranges = c->ndone};
+    memcpy(h.magic, CHECKPOINT_MAGIC, 8);
+    for (int t = 0; t < ntables; t++) {
+        n[t] = flatten_table(&tables[t], &words[t], &text[t], &counts[t]);
+        h.words += n[t];
+        h.text_bytes += text[t];
+    }
+
+    size_t ranges_bytes = c->ndone * 2 * sizeof(int64_t);
+    size_t len = sizeof(h) + ranges_bytes + h.words * sizeof(int64_t) + h.text_bytes;
+    char *data = malloc(len);
+    char *p = data;
+    memcpy(p, &h, sizeof(h));
+    p += sizeof(h);
+    for (size_t i = 0; i < c->ndone; i++) {
+        int64_t range[2] = {c->done[i].begin, c->done[i].end};
+        memcpy(p, range, sizeof(range));
+        p += sizeof(range);
+    }
+    char *text_out = p + h.words * sizeof(int64_t);
+    for (int t = 0; t < ntables; t++) {
+        for (long long i = 0; i < n[t]; i++) {
+            int64_t count = counts[t][i];
+            memcpy(p, &count, sizeof(count));
+            p += sizeof(count);
+        }
+        memcpy(text_out, words[t], text[t]);
+        text_out += text[t];
+        free(words[t]);
+        free(counts[t]);
+    }
+    free(words);
+    free(counts);
+    free(n);
+    free(text);
+
+    char path[4096], tmp[4096];
+    checkpoint_path(path, sizeof(path), c->prefix, c->run, rank, 0);
+    checkpoint_path(tmp, sizeof(tmp), c->prefix, c->run, rank, 1);
+    int rc = checkpoint_replace(path, tmp, data, len);
+    free(data);
+    if (rc != 0) {
+        fprintf(stderr, "Error: Could not write checkpoint %s\n", path);
+        return -1;
+    }
+
+    c->last = MPI_Wtime();
+    c->written++;
+    c->bytes += (long long)len;
+    c->seconds += c->last - start;
+    return 0;
+}
+
+// Write a checkpoint if the interval has passed since the last one. Only this
+// rank takes part, so ranks checkpoint whenever they reach a window boundary.
+int checkpoint_maybe(Checkpoint *c, const WordTable *tables, int ntables) {
+    if (!c->prefix || MPI_Wtime() - c->last < c->interval)
+        return 0;
+    return checkpoint_write(c, tables, ntables);
+}
+
+// Add one checkpoint file's words to table and its ranges to c->done.
+static int checkpoint_load(Checkpoint *c, const char *path, uint64_t run, WordTable *table) {
+    MPI_File file;
+    if (MPI_File_open(MPI_COMM_SELF, path, MPI_MODE_RDONLY, MPI_INFO_NULL, &file) != MPI_SUCCESS) {
+        fprintf(stderr, "Error: Could not open checkpoint %s\n", path);
+        return -1;
+    }
+    CheckpointHeader h;
+    int rc = checkpoint_read_at(file, 0, &h, sizeof(h));
+    if (rc != 0 || memcmp(h.magic, CHECKPOINT_MAGIC, 8) != 0 || h.run != run ||
+        h.input_size != (uint64_t)c->input_size) {
+        fprintf(stderr, "Error: %s is not a checkpoint of this run\n", path);
+        MPI_File_close(&file);
+        return -1;
+    }
+
+    int64_t *ranges = malloc(h.ranges ? h.ranges * 2 * sizeof(int64_t) : 1);
+    int64_t *counts = malloc(h.words ? h.words * sizeof(int64_t) : 1);
+    char *text = malloc(h.text_bytes ? h.text_bytes : 1);
+    MPI_Offset offset = sizeof(h);
+    rc = checkpoint_read_at(file, offset, ranges, h.ranges * 2 * sizeof(int64_t));
+    offset += h.ranges * 2 * sizeof(int64_t);
+    if (rc == 0)
+        rc = checkpoint_read_at(file, offset, counts, h.words * sizeof(int64_t));
+    offset += h.words * sizeof(int64_t);
+    if (rc == 0)
+        rc = checkpoint_read_at(file, offset, text, h.text_bytes);
+    MPI_File_close(&file);
+
+    if (rc == 0) {
+        for (uint64_t i = 0; i < h.ranges; i++)
+            checkpoint_done(c, ranges[2 * i], ranges[2 * i + 1]);
+        const char *p = text, *end = text + h.text_bytes;
+        for (uint64_t i = 0; i < h.words && p < end; i++) {
+            uint32_t len = (uint32_t)strnlen(p, end - p);
+            word_table_add_hashed(table, p, len, word_hash(p, len), counts[i]);
+            p += len + 1;
+        }
+    } else {
+        fprintf(stderr, "Error: Checkpoint %s is truncated\n", path);
+    }
+    free(ranges);
+    free(counts);
+    free(text);
+    return rc;
+}
+
+static int checkpoint_all_ok(int ok) {
+    int all;
+    MPI_Allreduce(&ok, &all, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD);
+    return all;
+}
+
+static int compare_ranges(const void *a, const void *b) {
+    MPI_Offset x = ((const ByteRange *)a)->begin, y = ((const ByteRange *)b)->begin;
+    return x < y ? -1 : x > y;
+}
+
+// Collective: the ranges of [0, input_size) that no rank's checkpoint covers.
+static ByteRange *checkpoint_todo(const Checkpoint *c, size_t *ntodo) {
+    int size;
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+    int count = (int)(2 * c->ndone), total = 0;
+    int *counts = malloc(size * sizeof(int));
+    int *displs = malloc(size * sizeof(int));
+    MPI_Allgather(&count, 1, MPI_INT, counts, 1, MPI_INT, MPI_COMM_WORLD);
+    for (int r = 0; r < size; r++) {
+        displs[r] = total;
+        total += counts[r];
+    }
+    long long *mine = malloc((count ? count : 1) * sizeof(long long));
+    for (size_t i = 0; i < c->ndone; i++) {
+        mine[2 * i] = c->done[i].begin;
+        mine[2 * i + 1] = c->done[i].end;
+    }
+    long long *all = malloc((total ? total : 1) * sizeof(long long));
+    MPI_Allgatherv(mine, count, MPI_LONG_LONG, all, counts, displs, MPI_LONG_LONG, MPI_COMM_WORLD);
+    free(mine);
+    free(counts);
+    free(displs);
+
+    size_t ndone = (size_t)total / 2;
+    ByteRange *done = malloc((ndone ? ndone : 1) * sizeof(ByteRange));
+    for (size_t i = 0; i < ndone; i++)
+        done[i] = (ByteRange){all[2 * i], all[2 * i + 1]};
+    free(all);
+    qsort(done, ndone, sizeof(ByteRange), compare_ranges);
+
+    ByteRange *todo = malloc((ndone + 1) * sizeof(ByteRange));
+    size_t n = 0;
+    MPI_Offset pos = 0;
+    for (size_t i = 0; i < ndone; i++) {
+        if (done[i].begin > pos)
+            todo[n++] = (ByteRange){pos, done[i].begin};
+        if (done[i].end > pos)
+            pos = done[i].end;
+    }
+    if (pos < c->input_size)
+        todo[n++] = (ByteRange){pos, c->input_size};
+    free(done);
+    *ntodo = n;
+    return todo;
+}
+
+// Collective. Resume from the checkpoint set named by the manifest at
+// prefix, if there is one: each rank loads every size-th file of the old set
+// into table. Then start a new set holding the same counts under the next
+// run number and make it current. Fills todo with the ranges still to count,
+// the whole input on a fresh start. Returns -1 on every rank if any rank
+// fails.
+int checkpoint_begin(Checkpoint *c, const char *prefix, double interval, MPI_Offset input_size, WordTable *table,
+                     ByteRange **todo, size_t *ntodo) {
+    int rank, size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+    memset(c, 0, sizeof(*c));
+    c->prefix = prefix;
+    c->interval = interval;
+    c->input_size = input_size;
+
+    // Rank 0 reads the manifest; a missing one means a fresh start
+    CheckpointManifest m = {0};
+    int found = 0;
+    if (rank == 0) {
+        FILE *f = fopen(prefix, "rb");
+        if (f) {
+            found = fread(&m, sizeof(m), 1, f) == 1 && memcmp(m.magic, CHECKPOINT_MANIFEST_MAGIC, 8) == 0 ? 1 : -1;
+            fclose(f);
+            if (found < 0)
+                fprintf(stderr, "Error: %s is not a checkpoint manifest\n", prefix);
+            else if (m.input_size != (uint64_t)input_size) {
+                fprintf(stderr, "Error: Checkpoint %s is for a %llu-byte input, not %lld bytes\n", prefix,
+                        (unsigned long long)m.input_size, (long long)input_size);
+                found = -1;
+            }
+        }
+    }
+    MPI_Bcast(&found, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&m, sizeof(m), MPI_BYTE, 0, MPI_COMM_WORLD);
+    if (found < 0)
+        return -1;
+
+    char path[4096];
+    int ok = 1;
+    if (found) {
+        for (uint32_t r = rank; r < m.ranks && ok; r += size) {
+            checkpoint_path(path, sizeof(path), prefix, m.run, (int)r, 0);
+            ok = checkpoint_load(c, path, m.run, table) == 0;
+        }
+    }
+    if (!checkpoint_all_ok(ok))
+        return -1;
+
+    // The new set must be complete before the manifest points at it
+    c->run = found ? m.run + 1 : 1;
+    if (!checkpoint_all_ok(checkpoint_write(c, table, 1) == 0))
+        return -1;
+    if (rank == 0) {
+        CheckpointManifest next = {.ranks = (uint32_t)size, .run = c->run, .input_size = (uint64_t)input_size};
+        memcpy(next.magic, CHECKPOINT_MANIFEST_MAGIC, 8);
+        char tmp[4096];
+        snprintf(tmp, sizeof(tmp), "%s.tmp", prefix);
+        ok = checkpoint_replace(prefix, tmp, &next, sizeof(next)) == 0;
+        if (!ok)
+            fprintf(stderr, "Error: Could not write checkpoint manifest %s\n", prefix);
+    }
+    MPI_Bcast(&ok, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (!ok)
+        return -1;
+    if (found) {
+        for (uint32_t r = rank; r < m.ranks; r += size) {
+            for (int tmp = 0; tmp < 2; tmp++) {
+                checkpoint_path(path, sizeof(path), prefix, m.run, (int)r, tmp);
+                MPI_File_delete(path, MPI_INFO_NULL);
+            }
+        }
+    }
+
+    *todo = checkpoint_todo(c, ntodo);
+    if (rank == 0 && found) {
+        MPI_Offset left = 0;
+        for (size_t i = 0; i < *ntodo; i++)
+            left += (*todo)[i].end - (*todo)[i].begin;
+        printf("Resuming from checkpoint run %llu of %u ranks: %lld of %lld bytes left to count\n",
+               (unsigned long long)m.run, m.ranks, (long long)left, (long long)input_size);
+    }
+    return 0;
+}
+
+// Collective, once the results are written: print what checkpointing cost
+// and remove the manifest and every rank's file.
+void checkpoint_finish(Checkpoint *c) {
+    if (!c->prefix)
+        return;
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    printf("Rank %d wrote %lld checkpoints (%lld bytes) in %.4f seconds\n", rank, c->written, c->bytes, c->seconds);
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    if (rank == 0)
+        remove(c->prefix);
+    MPI_Barrier(MPI_COMM_WORLD);
+    char path[4096];
+    checkpoint_path(path, sizeof(path), c->prefix, c->run, rank, 0);
+    MPI_File_delete(path, MPI_INFO_NULL);
+    free(c->done);
+}
+
+#endif
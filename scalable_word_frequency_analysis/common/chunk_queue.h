@@ -0,0 +1,147 @@
+#ifndef CHUNK_QUEUE_H
+#define CHUNK_QUEUE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <mpi.h>
+
+#include "window_io.h"
+
+// Hands out the byte ranges of the input file to ranks. Statically, each
+// rank gets one range of file_size / size bytes. Dynamically, the file is cut
+// into DYNAMIC_CHUNK-byte chunks and a rank claims the next one whenever it
+// finishes the last, by atomically incrementing a counter held on rank 0
+// (MPI_Fetch_and_op), so faster ranks simply take more chunks. Chunks need no
+// alignment: a word belongs to the range holding its first byte, whatever
+// range that is.
+//
+// The queue may also be given only some ranges of the file, such as the ones
+// a restarted run still has to count. Their bytes are then split as if they
+// were one file laid end to end, and a share that spans a gap is handed out
+// one piece at a time.
+
+#ifndef DYNAMIC_CHUNK
+#define DYNAMIC_CHUNK (16 * 1024 * 1024)
+#endif
+
+typedef struct {
+    MPI_Offset begin, end;
+} ByteRange;
+
+typedef struct {
+    int dynamic;
+    MPI_Offset file_size;
+    ByteRange *ranges;      // what is left to count, in file order
+    MPI_Offset *starts;     // offset of each range with the gaps left out
+    size_t nranges;
+    MPI_Offset total;       // bytes in all ranges
+    MPI_Offset begin, end;  // share still to hand out, gaps left out
+    MPI_Win win;
+    long long *next_chunk;  // counter exposed by rank 0
+    long long chunks, bytes;
+} ChunkQueue;
+
+// Collective. Splits the given ranges of the file, which must not overlap.
+void chunk_queue_init_ranges(ChunkQueue *q, MPI_Offset file_size, const ByteRange *ranges, size_t nranges,
+                             int dynamic) {
+    int rank, size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+    q->dynamic = dynamic;
+    q->file_size = file_size;
+    q->ranges = malloc((nranges ? nranges : 1) * sizeof(ByteRange));
+    q->starts = malloc((nranges ? nranges : 1) * sizeof(MPI_Offset));
+    q->nranges = nranges;
+    q->total = 0;
+    for (size_t i = 0; i < nranges; i++) {
+        q->ranges[i] = ranges[i];
+        q->starts[i] = q->total;
+        q->total += ranges[i].end - ranges[i].begin;
+    }
+    q->chunks = q->bytes = 0;
+    q->begin = q->end = 0;
+    if (!dynamic) {
+        partition_range(q->total, rank, size, &q->begin, &q->end);
+    } else {
+        MPI_Win_allocate(rank == 0 ? sizeof(long long) : 0, sizeof(long long), MPI_INFO_NULL, MPI_COMM_WORLD,
+                         &q->next_chunk, &q->win);
+        if (rank == 0)
+            *q->next_chunk = 0;
+        MPI_Barrier(MPI_COMM_WORLD);
+        MPI_Win_lock_all(0, q->win);
+    }
+}
+
+// Collective. Splits the whole file.
+void chunk_queue_init(ChunkQueue *q, MPI_Offset file_size, int dynamic) {
+    ByteRange all = {0, file_size};
+    chunk_queue_init_ranges(q, file_size, &all, 1, dynamic);
+}
+
+// Claim the next range. Returns 0 once the file is exhausted.
+int chunk_queue_next(ChunkQueue *q, MPI_Offset *begin, MPI_Offset *end) {
+    if (q->begin >= q->end) {
+        if (!q->dynamic)
+            return 0;
+        long long one = 1, chunk;
+        MPI_Fetch_and_op(&one, &chunk, MPI_LONG_LONG, 0, 0, MPI_SUM, q->win);
+        MPI_Win_flush(0, q->win);
+        q->begin = (MPI_Offset)chunk * DYNAMIC_CHUNK;
+        if (q->begin >= q->total)
+            return 0;
+        q->end = q->begin + DYNAMIC_CHUNK < q->total ? q->begin + DYNAMIC_CHUNK : q->total;
+    }
+
+    // The last range starting at or before the share, found by binary search
+    size_t lo = 0, hi = q->nranges;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (q->starts[mid] <= q->begin)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    MPI_Offset range_left = q->starts[lo] + (q->ranges[lo].end - q->ranges[lo].begin) - q->begin;
+    MPI_Offset piece = q->end - q->begin < range_left ? q->end - q->begin : range_left;
+    *begin = q->ranges[lo].begin + (q->begin - q->starts[lo]);
+    *end = *begin + piece;
+    q->begin += piece;
+    q->chunks++;
+    q->bytes += piece;
+    return 1;
+}
+
+// Collective: rank 0 prints the chunks, bytes and counting time of every rank.
+void chunk_queue_report(const ChunkQueue *q, double seconds) {
+    int rank, size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+    double mine[3] = {(double)q->chunks, (double)q->bytes, seconds};
+    double *all = rank == 0 ? malloc(3 * size * sizeof(double)) : NULL;
+    MPI_Gather(mine, 3, MPI_DOUBLE, all, 3, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    if (rank != 0)
+        return;
+
+    double max_bytes = 0;
+    for (int r = 0; r < size; r++) {
+        printf("Rank %d: %.0f chunks, %.0f bytes, %.4f seconds\n", r, all[3 * r], all[3 * r + 1], all[3 * r + 2]);
+        if (all[3 * r + 1] > max_bytes)
+            max_bytes = all[3 * r + 1];
+    }
+    if (q->total > 0)
+        printf("Largest share: %.2fx the mean (%s distribution)\n", max_bytes * size / q->total,
+               q->dynamic ? "dynamic" : "static");
+    free(all);
+}
+
+// Collective.
+void chunk_queue_free(ChunkQueue *q) {
+    free(q->ranges);
+    free(q->starts);
+    if (q->dynamic) {
+        MPI_Win_unlock_all(q->win);
+        MPI_Win_free(&q->win);
+    }
+}
+
+#endif
@@ -0,0 +1,542 @@
+#ifndef DOC_MATRIX_H
+#define DOC_MATRIX_H
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "file_map.h"
+#include "sort.h"
+#include "tokenize.h"
+#include "word_table.h"
+
+// Per-document term counts, written as a sparse term-document matrix in CSR
+// form. A document is a line, a record ending in a separator string, or a
+// whole input file.
+//
+// Each worker (thread or rank) counts the documents of its parts of the
+// input into its own row buffer: (term, count) entries back to back, with
+// term IDs local to the worker's vocabulary. Like a word, a document belongs
+// to the range that holds its first byte; the worker that opens it reads on
+// past its range to the next separator. At the end the vocabularies are
+// merged into one sorted vocabulary, the rows are renumbered to it, and
+// every part is written at the place its byte offset gives it in the file.
+
+#define DOC_SEPARATOR_MAX 16
+#define DOC_MATRIX_MAGIC "TDMATRIX"
+#define DOC_MATRIX_VERSION 1
+
+// Entries written per call, which bounds the write buffers.
+#define DOC_WRITE_BATCH (1 << 20)
+
+enum {
+    DOCS_NONE,      // one table for the whole input, the default
+    DOCS_LINE,      // each line is a document
+    DOCS_RECORD,    // documents end with a separator string
+    DOCS_FILE,      // the input lists files, one path per line; each is a document
+};
+
+typedef struct {
+    int mode;
+    char sep[DOC_SEPARATOR_MAX];
+    size_t sep_len;     // 0 in file mode
+} DocSpec;
+
+// Set the separator from a string with \n, \t, \r, \f, \\ and \xHH escapes.
+// Separators are ASCII non-letters, so no word can run across one.
+int doc_spec_set_separator(DocSpec *spec, const char *text) {
+    size_t n = 0;
+    for (const char *p = text; *p; n++) {
+        if (n == DOC_SEPARATOR_MAX) {
+            fprintf(stderr, "--doc-separator is longer than %d bytes\n", DOC_SEPARATOR_MAX);
+            return -1;
+        }
+        unsigned char c = (unsigned char)*p++;
+        if (c == '\\' && *p) {
+            char e = *p++;
+            if (e == 'n')
+                c = '\n';
+            else if (e == 't')
+                c = '\t';
+            else if (e == 'r')
+                c = '\r';
+            else if (e == 'f')
+                c = '\f';
+            else if (e == 'x' && isxdigit((unsigned char)p[0]) && isxdigit((unsigned char)p[1])) {
+                char hex[3] = {p[0], p[1], '\0'};
+                c = (unsigned char)strtol(hex, NULL, 16);
+                p += 2;
+            } else
+                c = (unsigned char)e;
+        }
+        if (c >= 0x80 || isalpha(c)) {
+            fprintf(stderr, "--doc-separator must be ASCII and hold no letters\n");
+            return -1;
+        }
+        spec->sep[n] = (char)c;
+    }
+    if (n == 0) {
+        fprintf(stderr, "--doc-separator must not be empty\n");
+        return -1;
+    }
+    spec->sep_len = n;
+    return 0;
+}
+
+// Start of the first separator that begins in buf[i, hi), or hi if none
+// does. Overlapping occurrences each count, so the result never depends on
+// where a range starts.
+static size_t doc_find_separator(const DocSpec *spec, const char *buf, size_t len, size_t i, size_t hi) {
+    if (spec->sep_len == 0)
+        return hi;
+    while (i < hi) {
+        const char *p = memchr(buf + i, spec->sep[0], hi - i);
+        if (!p)
+            return hi;
+        i = (size_t)(p - buf);
+        if (i + spec->sep_len <= len && memcmp(p, spec->sep, spec->sep_len) == 0)
+            return i;
+        i++;
+    }
+    return hi;
+}
+
+typedef struct {
+    uint32_t term;
+    uint32_t count;
+} DocEntry;
+
+// A contiguous run of the input counted by one worker. key orders the parts
+// in the output: the byte offset where the part starts, or the file's
+// position in the list in file mode.
+typedef struct {
+    uint64_t key;
+    size_t first_row, first_entry;
+    size_t rows, entries;
+} DocPart;
+
+typedef struct {
+    const DocSpec *spec;
+    int utf8;
+    WordTable vocab;        // this worker's terms; counts are document frequencies
+    int open;               // a document is being counted
+    uint32_t *words;        // term of every word of the open document
+    size_t nwords, words_cap;
+    uint32_t *row_entries;  // entries of every finished row
+    size_t rows, rows_cap;
+    DocEntry *entries;      // each row's entries by term, row after row
+    size_t nentries, entries_cap;
+    DocPart *parts;
+    size_t nparts, parts_cap;
+} DocRows;
+
+void doc_rows_init(DocRows *d, const DocSpec *spec, int utf8) {
+    memset(d, 0, sizeof(*d));
+    d->spec = spec;
+    d->utf8 = utf8;
+    word_table_init(&d->vocab);
+}
+
+void doc_rows_free(DocRows *d) {
+    word_table_free(&d->vocab);
+    free(d->words);
+    free(d->row_entries);
+    free(d->entries);
+    free(d->parts);
+}
+
+static void doc_add_word(void *ctx, char *word) {
+    DocRows *d = ctx;
+    uint32_t len = (uint32_t)strlen(word);
+    if (len == 0)
+        return;
+    if (d->nwords == d->words_cap) {
+        d->words_cap = d->words_cap ? d->words_cap * 2 : 256;
+        d->words = realloc(d->words, d->words_cap * sizeof(uint32_t));
+    }
+    d->words[d->nwords++] = (uint32_t)word_table_add_hashed(&d->vocab, word, len, word_hash(word, len), 0);
+}
+
+static int compare_terms(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void doc_open(DocRows *d) {
+    d->open = 1;
+    d->nwords = 0;
+}
+
+// Turn the open document's words into a row of (term, count) entries.
+static void doc_close(DocRows *d) {
+    qsort(d->words, d->nwords, sizeof(uint32_t), compare_terms);
+    if (d->rows == d->rows_cap) {
+        d->rows_cap = d->rows_cap ? d->rows_cap * 2 : 1024;
+        d->row_entries = realloc(d->row_entries, d->rows_cap * sizeof(uint32_t));
+    }
+    size_t first = d->nentries;
+    for (size_t i = 0, j; i < d->nwords; i = j) {
+        for (j = i + 1; j < d->nwords && d->words[j] == d->words[i]; j++)
+            ;
+        if (d->nentries == d->entries_cap) {
+            d->entries_cap = d->entries_cap ? d->entries_cap * 2 : 4096;
+            d->entries = realloc(d->entries, d->entries_cap * sizeof(DocEntry));
+        }
+        d->entries[d->nentries++] = (DocEntry){d->words[i], (uint32_t)(j - i)};
+        word_table_entry(&d->vocab, d->words[i])->count++;
+    }
+    d->row_entries[d->rows++] = (uint32_t)(d->nentries - first);
+    d->open = 0;
+}
+
+// Start a part. starts_doc says whether a document begins at its first
+// byte: the start of a non-empty input, or any file in file mode.
+void doc_rows_begin_part(DocRows *d, uint64_t key, int starts_doc) {
+    if (d->nparts == d->parts_cap) {
+        d->parts_cap = d->parts_cap ? d->parts_cap * 2 : 16;
+        d->parts = realloc(d->parts, d->parts_cap * sizeof(DocPart));
+    }
+    d->parts[d->nparts++] = (DocPart){key, d->rows, d->nentries, 0, 0};
+    if (starts_doc)
+        doc_open(d);
+}
+
+// Count the words and separators that start in buf[lo, hi) of the current
+// part; bytes outside [lo, hi) are context. eof says whether buf ends where
+// the input does, so a final separator opens no empty document. Words
+// before the part's first separator belong to the previous part and are
+// skipped.
+//
+// With tail set, only the document left open by the part is counted, up to
+// its separator; returns 1 once that separator is found, 0 if the document
+// may go on past hi.
+int doc_rows_scan(DocRows *d, const char *buf, size_t len, size_t lo, size_t hi, int eof, int tail) {
+    if (tail && !d->open)
+        return 1;
+    size_t i = lo;
+    for (;;) {
+        size_t sep = doc_find_separator(d->spec, buf, len, i, hi);
+        if (d->open)
+            scan_range(d->utf8, buf, len, i, sep, doc_add_word, d);
+        if (sep == hi)
+            return 0;
+        if (d->open)
+            doc_close(d);
+        if (tail)
+            return 1;
+        if (!eof || sep + d->spec->sep_len < len)
+            doc_open(d);
+        i = sep + 1;
+    }
+}
+
+// Close the part, and with it the document left open at the end of the input.
+void doc_rows_end_part(DocRows *d) {
+    if (d->open)
+        doc_close(d);
+    DocPart *p = &d->parts[d->nparts - 1];
+    p->rows = d->rows - p->first_row;
+    p->entries = d->nentries - p->first_entry;
+}
+
+// One document holding all of a file, for file mode. A file that cannot
+// be read still gets its (empty) row, so document IDs match the list.
+int doc_rows_add_file(DocRows *d, const char *path, uint64_t key) {
+    const char *data;
+    size_t size;
+    int rc = map_input(path, &data, &size);
+    doc_rows_begin_part(d, key, 1);
+    if (rc == 0) {
+        doc_rows_scan(d, data, size, 0, size, 1, 0);
+        unmap_input(data, size);
+    }
+    doc_rows_end_part(d);
+    return rc;
+}
+
+// The paths listed in a file, one per line. Blank lines are skipped.
+int doc_read_list(const char *filename, char ***paths_out, size_t *n_out) {
+    const char *data;
+    size_t size, n = 0, cap = 0;
+    char **paths = NULL;
+    *paths_out = NULL;
+    *n_out = 0;
+    if (map_input(filename, &data, &size) != 0)
+        return -1;
+    for (size_t i = 0, j; i < size; i = j + 1) {
+        for (j = i; j < size && data[j] != '\n'; j++)
+            ;
+        size_t end = j;
+        if (end > i && data[end - 1] == '\r')
+            end--;
+        if (end == i)
+            continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            paths = realloc(paths, cap * sizeof(char *));
+        }
+        paths[n] = malloc(end - i + 1);
+        memcpy(paths[n], data + i, end - i);
+        paths[n++][end - i] = '\0';
+    }
+    unmap_input(data, size);
+    *paths_out = paths;
+    *n_out = n;
+    return 0;
+}
+
+void doc_free_list(char **paths, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        free(paths[i]);
+    free(paths);
+}
+
+// The shared vocabulary: merged's terms in alphabetical order, so a term's
+// ID is its entry index. Counts stay document frequencies.
+void doc_vocab_build(WordTable *vocab, const WordTable *merged) {
+    WordEntry **sorted = sorted_entries(merged, SORT_ALPHA);
+    word_table_init(vocab);
+    for (size_t i = 0; i < merged->used; i++)
+        word_table_add_hashed(vocab, sorted[i]->word, sorted[i]->len, word_hash(sorted[i]->word, sorted[i]->len),
+                              sorted[i]->count);
+    free(sorted);
+}
+
+static int compare_doc_entries(const void *a, const void *b) {
+    return compare_terms(&((const DocEntry *)a)->term, &((const DocEntry *)b)->term);
+}
+
+// Renumber d's rows from its own term IDs to the shared vocabulary's, and
+// put every row back in term order.
+void doc_rows_remap(DocRows *d, const WordTable *vocab) {
+    uint32_t *ids = malloc((d->vocab.used ? d->vocab.used : 1) * sizeof(uint32_t));
+    for (size_t s = 0; s < d->vocab.cap; s++) {
+        uint64_t slot = d->vocab.slots[s];
+        if (!slot)
+            continue;
+        const WordEntry *e = word_table_entry(&d->vocab, (uint32_t)slot - 1);
+        ids[(uint32_t)slot - 1] = (uint32_t)word_table_find(vocab, e->word, e->len, slot >> 32);
+    }
+    DocEntry *row = d->entries;
+    for (size_t r = 0; r < d->rows; r++) {
+        for (uint32_t k = 0; k < d->row_entries[r]; k++)
+            row[k].term = ids[row[k].term];
+        qsort(row, d->row_entries[r], sizeof(DocEntry), compare_doc_entries);
+        row += d->row_entries[r];
+    }
+    free(ids);
+}
+
+// Where a part lands in the matrix.
+typedef struct {
+    uint64_t key, rows, entries;
+    uint64_t first_doc, first_entry;
+} DocPlace;
+
+static int compare_places(const void *a, const void *b) {
+    uint64_t x = ((const DocPlace *)a)->key, y = ((const DocPlace *)b)->key;
+    return x < y ? -1 : x > y;
+}
+
+// Order every worker's parts by key and give each its first document and
+// first entry. Returns the document count; *entries gets the entry count.
+uint64_t doc_places_assign(DocPlace *places, size_t n, uint64_t *entries) {
+    qsort(places, n, sizeof(DocPlace), compare_places);
+    uint64_t docs = 0, nz = 0;
+    for (size_t i = 0; i < n; i++) {
+        places[i].first_doc = docs;
+        places[i].first_entry = nz;
+        docs += places[i].rows;
+        nz += places[i].entries;
+    }
+    *entries = nz;
+    return docs;
+}
+
+static const DocPlace *doc_place_find(const DocPlace *places, size_t n, uint64_t key) {
+    DocPlace probe = {.key = key};
+    return bsearch(&probe, places, n, sizeof(DocPlace), compare_places);
+}
+
+// The file starts with this header; every offset is from the start of the
+// file and 8-byte aligned, so the arrays can be used in place once mapped.
+// Integers are in the byte order of the machine that wrote the file.
+typedef struct {
+    char magic[8];              // DOC_MATRIX_MAGIC
+    uint64_t version;
+    uint64_t docs, terms, entries;
+    uint64_t row_ptr;           // docs + 1 uint64: row r is entries [row_ptr[r], row_ptr[r + 1])
+    uint64_t cols;              // entries uint32 term IDs, ascending within a row
+    uint64_t vals;              // entries uint32 counts
+    uint64_t df;                // terms uint64 document frequencies
+    uint64_t term_ptr;          // terms + 1 uint64 offsets into the term text
+    uint64_t term_text;         // NUL-terminated terms in alphabetical order
+    uint64_t file_size;
+} DocMatrixHeader;
+
+static uint64_t doc_align(uint64_t x) {
+    return (x + 7) & ~(uint64_t)7;
+}
+
+void doc_matrix_layout(DocMatrixHeader *h, uint64_t docs, uint64_t entries, const WordTable *vocab) {
+    uint64_t text = 0;
+    for (size_t i = 0; i < vocab->used; i++)
+        text += word_table_entry(vocab, i)->len + 1;
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, DOC_MATRIX_MAGIC, 8);
+    h->version = DOC_MATRIX_VERSION;
+    h->docs = docs;
+    h->terms = vocab->used;
+    h->entries = entries;
+    h->row_ptr = doc_align(sizeof(*h));
+    h->cols = doc_align(h->row_ptr + (docs + 1) * sizeof(uint64_t));
+    h->vals = doc_align(h->cols + entries * sizeof(uint32_t));
+    h->df = doc_align(h->vals + entries * sizeof(uint32_t));
+    h->term_ptr = h->df + h->terms * sizeof(uint64_t);
+    h->term_text = h->term_ptr + (h->terms + 1) * sizeof(uint64_t);
+    h->file_size = h->term_text + text;
+}
+
+// Writes len bytes at offset; returns 0 on success.
+typedef int (*DocWriteFn)(void *ctx, uint64_t offset, const void *data, size_t len);
+
+// The header, the vocabulary, its document frequencies and the closing
+// entry of the row pointers: everything but the rows themselves.
+int doc_matrix_write_vocab(const DocMatrixHeader *h, const WordTable *vocab, DocWriteFn write, void *ctx) {
+    int rc = write(ctx, 0, h, sizeof(*h));
+    rc |= write(ctx, h->row_ptr + h->docs * sizeof(uint64_t), &h->entries, sizeof(uint64_t));
+
+    uint64_t *df = malloc((h->terms ? h->terms : 1) * sizeof(uint64_t));
+    uint64_t *ptr = malloc((h->terms + 1) * sizeof(uint64_t));
+    char *text = malloc(h->file_size - h->term_text + 1);
+    uint64_t off = 0;
+    for (size_t i = 0; i < vocab->used; i++) {
+        const WordEntry *e = word_table_entry(vocab, i);
+        df[i] = (uint64_t)e->count;
+        ptr[i] = off;
+        memcpy(text + off, e->word, e->len + 1);
+        off += e->len + 1;
+    }
+    ptr[h->terms] = off;
+    rc |= write(ctx, h->df, df, h->terms * sizeof(uint64_t));
+    rc |= write(ctx, h->term_ptr, ptr, (h->terms + 1) * sizeof(uint64_t));
+    rc |= write(ctx, h->term_text, text, off);
+    free(df);
+    free(ptr);
+    free(text);
+    return rc;
+}
+
+// d's rows, each part at its place.
+int doc_rows_write(const DocRows *d, const DocMatrixHeader *h, const DocPlace *places, size_t nplaces, DocWriteFn write,
+                   void *ctx) {
+    uint64_t *ptr = malloc(DOC_WRITE_BATCH * sizeof(uint64_t));
+    uint32_t *cols = malloc(DOC_WRITE_BATCH * sizeof(uint32_t));
+    uint32_t *vals = malloc(DOC_WRITE_BATCH * sizeof(uint32_t));
+    int rc = 0;
+    for (size_t p = 0; p < d->nparts; p++) {
+        const DocPart *part = &d->parts[p];
+        const DocPlace *place = doc_place_find(places, nplaces, part->key);
+
+        uint64_t nz = place->first_entry;
+        for (size_t r = 0; r < part->rows; r += DOC_WRITE_BATCH) {
+            size_t n = part->rows - r < DOC_WRITE_BATCH ? part->rows - r : DOC_WRITE_BATCH;
+            for (size_t k = 0; k < n; k++) {
+                ptr[k] = nz;
+                nz += d->row_entries[part->first_row + r + k];
+            }
+            rc |= write(ctx, h->row_ptr + (place->first_doc + r) * sizeof(uint64_t), ptr, n * sizeof(uint64_t));
+        }
+
+        const DocEntry *e = d->entries + part->first_entry;
+        for (size_t k0 = 0; k0 < part->entries; k0 += DOC_WRITE_BATCH) {
+            size_t n = part->entries - k0 < DOC_WRITE_BATCH ? part->entries - k0 : DOC_WRITE_BATCH;
+            for (size_t k = 0; k < n; k++) {
+                cols[k] = e[k0 + k].term;
+                vals[k] = e[k0 + k].count;
+            }
+            uint64_t at = (place->first_entry + k0) * sizeof(uint32_t);
+            rc |= write(ctx, h->cols + at, cols, n * sizeof(uint32_t));
+            rc |= write(ctx, h->vals + at, vals, n * sizeof(uint32_t));
+        }
+    }
+    free(ptr);
+    free(cols);
+    free(vals);
+    return rc;
+}
+
+// Every worker's parts, ready for doc_places_assign().
+DocPlace *doc_collect_places(const DocRows *rows, int nworkers, size_t *n_out) {
+    size_t n = 0;
+    for (int w = 0; w < nworkers; w++)
+        n += rows[w].nparts;
+    DocPlace *places = malloc((n ? n : 1) * sizeof(DocPlace));
+    n = 0;
+    for (int w = 0; w < nworkers; w++) {
+        for (size_t p = 0; p < rows[w].nparts; p++)
+            places[n++] = (DocPlace){rows[w].parts[p].key, rows[w].parts[p].rows, rows[w].parts[p].entries, 0, 0};
+    }
+    *n_out = n;
+    return places;
+}
+
+static int doc_pwrite(void *ctx, uint64_t offset, const void *data, size_t len) {
+    int fd = *(int *)ctx;
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, (off_t)offset);
+        if (n <= 0) {
+            perror("Failed to write matrix file");
+            return -1;
+        }
+        p += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Single-process builds: merge the workers' vocabularies, renumber their
+// rows and write the matrix to filename. Fills h with what was written.
+int doc_matrix_save(const char *filename, DocRows *rows, int nworkers, DocMatrixHeader *h) {
+    WordTable merged, vocab;
+    word_table_init(&merged);
+    for (int w = 0; w < nworkers; w++)
+        word_table_merge(&merged, &rows[w].vocab);
+    doc_vocab_build(&vocab, &merged);
+    word_table_free(&merged);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for (int w = 0; w < nworkers; w++)
+        doc_rows_remap(&rows[w], &vocab);
+
+    size_t nplaces;
+    uint64_t entries;
+    DocPlace *places = doc_collect_places(rows, nworkers, &nplaces);
+    uint64_t docs = doc_places_assign(places, nplaces, &entries);
+    doc_matrix_layout(h, docs, entries, &vocab);
+
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("Failed to open matrix file");
+        free(places);
+        word_table_free(&vocab);
+        return -1;
+    }
+    int rc = doc_matrix_write_vocab(h, &vocab, doc_pwrite, &fd);
+    for (int w = 0; w < nworkers && rc == 0; w++)
+        rc = doc_rows_write(&rows[w], h, places, nplaces, doc_pwrite, &fd);
+    close(fd);
+    free(places);
+    word_table_free(&vocab);
+    return rc;
+}
+
+#endif
@@ -0,0 +1,195 @@
+#ifndef DOC_MATRIX_MPI_H
+#define DOC_MATRIX_MPI_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mpi.h>
+
+#include "doc_matrix.h"
+#include "window_io.h"
+
+// The MPI side of the term-document matrix. Each rank counts the documents
+// of its ranges (with one row buffer per thread in the hybrid build). Rank 0
+// builds the shared vocabulary from every rank's terms and broadcasts it,
+// every rank renumbers its rows, and all ranks write their parts straight
+// into one matrix file with MPI-IO.
+
+static int window_at_eof(const WindowReader *r, const Window *w) {
+    return w->start - (MPI_Offset)w->lo + (MPI_Offset)w->len == r->file_size;
+}
+
+// Count the window's bytes [lo, hi) into d.
+int doc_rows_scan_window(DocRows *d, const WindowReader *r, const Window *w, size_t lo, size_t hi, int tail) {
+    return doc_rows_scan(d, r->buf, w->len, lo, hi, window_at_eof(r, w), tail);
+}
+
+// Finish the document d left open at pos, reading on until its separator.
+// Reads start small, since most documents end soon after.
+void doc_rows_finish_range(DocRows *d, WindowReader *r, MPI_Offset pos) {
+    MPI_Offset step = 4096;
+    Window w;
+    while (d->open) {
+        MPI_Offset end = pos + step < r->file_size ? pos + step : r->file_size;
+        if (!window_read(r, pos, end, &w) || doc_rows_scan_window(d, r, &w, w.lo, w.hi, 1))
+            break;
+        pos += w.hi - w.lo;
+        if (step < READ_WINDOW)
+            step *= 2;
+    }
+}
+
+// Collective: the shared vocabulary of every rank's terms, in alphabetical
+// order. Rank 0 merges the ranks' terms one rank at a time and broadcasts
+// the sorted words; only rank 0's copy carries document frequencies.
+void doc_vocab_build_ranks(WordTable *vocab, const DocRows *rows, int nworkers) {
+    int rank, size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    WordTable merged;
+    word_table_init(&merged);
+    for (int w = 0; w < nworkers; w++)
+        word_table_merge(&merged, &rows[w].vocab);
+
+    char *words;
+    size_t bytes;
+    long long *counts;
+    long long n;
+    if (rank == 0) {
+        for (int src = 1; src < size; src++) {
+            long long header[2];
+            MPI_Recv(header, 2, MPI_LONG_LONG, src, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            words = malloc(header[1] ? header[1] : 1);
+            counts = malloc(header[0] ? header[0] * sizeof(long long) : 1);
+            recv_large(words, (size_t)header[1], src, 1, MPI_COMM_WORLD);
+            recv_large(counts, header[0] * sizeof(long long), src, 2, MPI_COMM_WORLD);
+            char *p = words;
+            for (long long i = 0; i < header[0]; i++) {
+                word_table_add(&merged, p, counts[i]);
+                p += strlen(p) + 1;
+            }
+            free(words);
+            free(counts);
+        }
+        doc_vocab_build(vocab, &merged);
+        n = flatten_table(vocab, &words, &bytes, &counts);
+        free(counts);
+    } else {
+        n = flatten_table(&merged, &words, &bytes, &counts);
+        long long header[2] = {n, (long long)bytes};
+        MPI_Send(header, 2, MPI_LONG_LONG, 0, 0, MPI_COMM_WORLD);
+        send_large(words, bytes, 0, 1, MPI_COMM_WORLD);
+        send_large(counts, n * sizeof(long long), 0, 2, MPI_COMM_WORLD);
+        free(words);
+        free(counts);
+    }
+    word_table_free(&merged);
+
+    long long header[2] = {n, (long long)bytes};
+    MPI_Bcast(header, 2, MPI_LONG_LONG, 0, MPI_COMM_WORLD);
+    if (rank != 0)
+        words = malloc(header[1] ? header[1] : 1);
+    bcast_large(words, (size_t)header[1], 0, MPI_COMM_WORLD);
+    if (rank != 0) {
+        word_table_init(vocab);
+        char *p = words;
+        for (long long i = 0; i < header[0]; i++) {
+            word_table_add(vocab, p, 0);
+            p += strlen(p) + 1;
+        }
+    }
+    free(words);
+}
+
+static int doc_mpi_write(void *ctx, uint64_t offset, const void *data, size_t len) {
+    MPI_File file = *(MPI_File *)ctx;
+    const char *p = data;
+    while (len > 0) {
+        int piece = len > MAX_MSG_BYTES ? MAX_MSG_BYTES : (int)len;
+        if (MPI_File_write_at(file, (MPI_Offset)offset, p, piece, MPI_BYTE, MPI_STATUS_IGNORE) != MPI_SUCCESS) {
+            fprintf(stderr, "Error: Could not write matrix file\n");
+            return -1;
+        }
+        p += piece;
+        offset += piece;
+        len -= piece;
+    }
+    return 0;
+}
+
+// Collective: build the shared vocabulary, renumber this rank's rows and
+// write every rank's parts into filename. Fills h with what was written.
+int doc_matrix_save_ranks(const char *filename, DocRows *rows, int nworkers, DocMatrixHeader *h) {
+    int rank, size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    WordTable vocab;
+    doc_vocab_build_ranks(&vocab, rows, nworkers);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for (int w = 0; w < nworkers; w++)
+        doc_rows_remap(&rows[w], &vocab);
+
+    // Every rank learns where every part goes, as (key, rows, entries)
+    size_t mine;
+    DocPlace *local = doc_collect_places(rows, nworkers, &mine);
+    uint64_t *triples = malloc((mine ? mine : 1) * 3 * sizeof(uint64_t));
+    for (size_t i = 0; i < mine; i++) {
+        triples[3 * i] = local[i].key;
+        triples[3 * i + 1] = local[i].rows;
+        triples[3 * i + 2] = local[i].entries;
+    }
+    free(local);
+    int count = (int)(3 * mine), total = 0;
+    int *counts = malloc(size * sizeof(int));
+    int *displs = malloc(size * sizeof(int));
+    MPI_Allgather(&count, 1, MPI_INT, counts, 1, MPI_INT, MPI_COMM_WORLD);
+    for (int r = 0; r < size; r++) {
+        displs[r] = total;
+        total += counts[r];
+    }
+    uint64_t *all = malloc((total ? total : 1) * sizeof(uint64_t));
+    MPI_Allgatherv(triples, count, MPI_UINT64_T, all, counts, displs, MPI_UINT64_T, MPI_COMM_WORLD);
+    free(triples);
+    free(counts);
+    free(displs);
+
+    size_t nplaces = (size_t)total / 3;
+    DocPlace *places = malloc((nplaces ? nplaces : 1) * sizeof(DocPlace));
+    for (size_t i = 0; i < nplaces; i++)
+        places[i] = (DocPlace){all[3 * i], all[3 * i + 1], all[3 * i + 2], 0, 0};
+    free(all);
+    uint64_t entries;
+    uint64_t docs = doc_places_assign(places, nplaces, &entries);
+
+    // Every rank's vocabulary holds the same words, so the layout agrees
+    doc_matrix_layout(h, docs, entries, &vocab);
+
+    MPI_File file;
+    if (MPI_File_open(MPI_COMM_WORLD, filename, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &file) !=
+        MPI_SUCCESS) {
+        if (rank == 0)
+            fprintf(stderr, "Error: Could not open matrix file %s\n", filename);
+        free(places);
+        word_table_free(&vocab);
+        return -1;
+    }
+    MPI_File_set_size(file, 0);
+    int rc = 0;
+    if (rank == 0)
+        rc = doc_matrix_write_vocab(h, &vocab, doc_mpi_write, &file);
+    for (int w = 0; w < nworkers && rc == 0; w++)
+        rc = doc_rows_write(&rows[w], h, places, nplaces, doc_mpi_write, &file);
+    MPI_File_close(&file);
+    free(places);
+    word_table_free(&vocab);
+
+    int failed = rc != 0, any_failed;
+    MPI_Allreduce(&failed, &any_failed, 1, MPI_INT, MPI_LOR, MPI_COMM_WORLD);
+    return any_failed ? -1 : 0;
+}
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef FILE_MAP_H
+#define FILE_MAP_H
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Map a whole input file read-only so the scan kernel can run over it in
+// place. An empty file maps to a NULL buffer of size 0.
+int map_input(const char *filename, const char **data, size_t *size) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("File open failed");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("File stat failed");
+        close(fd);
+        return -1;
+    }
+    *size = (size_t)st.st_size;
+    *data = NULL;
+    if (*size > 0) {
+        void *p = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            perror("File mmap failed");
+            close(fd);
+            return -1;
+        }
+        madvise(p, *size, MADV_SEQUENTIAL);
+        *data = p;
+    }
+    close(fd);
+    return 0;
+}
+
+void unmap_input(const char *data, size_t size) {
+    if (data)
+        munmap((void *)data, size);
+}
+
+#endif
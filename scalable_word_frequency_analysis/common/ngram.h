@@ -0,0 +1,316 @@
+#ifndef NGRAM_H
+#define NGRAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// N-gram counting. Words are first interned to dense uint32 IDs in a Vocab;
+// n-grams are then counted as fixed-width ID tuples in an open-addressing
+// NgramTable, and IDs are only turned back into strings for output.
+#define NGRAM_MAX 3
+
+typedef struct {
+    uint32_t *slots;    // id + 1, 0 = empty
+    size_t cap;         // power of two
+    uint32_t count;
+    char *pool;         // NUL-terminated words, back to back
+    size_t pool_len, pool_cap;
+    size_t *offsets;    // id -> offset in pool
+    uint64_t *hashes;   // id -> hash, so growing never rehashes strings
+    size_t ids_cap;
+} Vocab;
+
+typedef struct {
+    int n;
+    uint32_t *keys;     // cap * n IDs
+    long long *counts;  // 0 = empty slot
+    size_t cap, used;
+} NgramTable;
+
+// Streams words into a table. history holds the previous n - 1 IDs; head
+// remembers the first n - 1 IDs pushed since the last ngram_begin_part()
+// so a piece counted on its own can later be joined to the one before it.
+typedef struct {
+    Vocab vocab;
+    NgramTable table;
+    uint32_t history[NGRAM_MAX];
+    uint32_t head[NGRAM_MAX];
+    int filled;
+    long long pushed;
+} NgramCounter;
+
+uint64_t hash_bytes(const char *s, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static inline uint64_t hash_ids(const uint32_t *ids, int n) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL;
+    for (int i = 0; i < n; i++) {
+        h = (h ^ ids[i]) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    return h;
+}
+
+void vocab_init(Vocab *v) {
+    memset(v, 0, sizeof(*v));
+    v->cap = 1024;
+    v->slots = calloc(v->cap, sizeof(uint32_t));
+    v->ids_cap = 512;
+    v->offsets = malloc(v->ids_cap * sizeof(size_t));
+    v->hashes = malloc(v->ids_cap * sizeof(uint64_t));
+    v->pool_cap = 4096;
+    v->pool = malloc(v->pool_cap);
+}
+
+void vocab_free(Vocab *v) {
+    free(v->slots);
+    free(v->offsets);
+    free(v->hashes);
+    free(v->pool);
+}
+
+const char *vocab_word(const Vocab *v, uint32_t id) {
+    return v->pool + v->offsets[id];
+}
+
+static void vocab_grow(Vocab *v) {
+    size_t cap = v->cap * 2;
+    uint32_t *slots = calloc(cap, sizeof(uint32_t));
+    for (uint32_t id = 0; id < v->count; id++) {
+        size_t i = v->hashes[id] & (cap - 1);
+        while (slots[i])
+            i = (i + 1) & (cap - 1);
+        slots[i] = id + 1;
+    }
+    free(v->slots);
+    v->slots = slots;
+    v->cap = cap;
+}
+
+uint32_t vocab_intern(Vocab *v, const char *word) {
+    size_t len = strlen(word);
+    uint64_t h = hash_bytes(word, len);
+    size_t i = h & (v->cap - 1);
+    while (v->slots[i]) {
+        uint32_t id = v->slots[i] - 1;
+        if (v->hashes[id] == h && strcmp(vocab_word(v, id), word) == 0)
+            return id;
+        i = (i + 1) & (v->cap - 1);
+    }
+
+    uint32_t id = v->count++;
+    if (id == v->ids_cap) {
+        v->ids_cap *= 2;
+        v->offsets = realloc(v->offsets, v->ids_cap * sizeof(size_t));
+        v->hashes = realloc(v->hashes, v->ids_cap * sizeof(uint64_t));
+    }
+    while (v->pool_len + len + 1 > v->pool_cap) {
+        v->pool_cap *= 2;
+        v->pool = realloc(v->pool, v->pool_cap);
+    }
+    memcpy(v->pool + v->pool_len, word, len + 1);
+    v->offsets[id] = v->pool_len;
+    v->hashes[id] = h;
+    v->pool_len += len + 1;
+    v->slots[i] = id + 1;
+
+    if (v->count * 2 > v->cap)
+        vocab_grow(v);
+    return id;
+}
+
+void ngram_table_init(NgramTable *t, int n) {
+    t->n = n;
+    t->cap = 1024;
+    t->used = 0;
+    t->keys = malloc(t->cap * n * sizeof(uint32_t));
+    t->counts = calloc(t->cap, sizeof(long long));
+}
+
+void ngram_table_free(NgramTable *t) {
+    free(t->keys);
+    free(t->counts);
+}
+
+static void ngram_table_grow(NgramTable *t) {
+    size_t cap = t->cap * 2;
+    uint32_t *keys = malloc(cap * t->n * sizeof(uint32_t));
+    long long *counts = calloc(cap, sizeof(long long));
+    for (size_t s = 0; s < t->cap; s++) {
+        if (!t->counts[s])
+            continue;
+        const uint32_t *key = t->keys + s * t->n;
+        size_t i = hash_ids(key, t->n) & (cap - 1);
+        while (counts[i])
+            i = (i + 1) & (cap - 1);
+        memcpy(keys + i * t->n, key, t->n * sizeof(uint32_t));
+        counts[i] = t->counts[s];
+    }
+    free(t->keys);
+    free(t->counts);
+    t->keys = keys;
+    t->counts = counts;
+    t->cap = cap;
+}
+
+void ngram_table_add(NgramTable *t, const uint32_t *ids, long long count) {
+    size_t i = hash_ids(ids, t->n) & (t->cap - 1);
+    while (t->counts[i]) {
+        if (memcmp(t->keys + i * t->n, ids, t->n * sizeof(uint32_t)) == 0) {
+            t->counts[i] += count;
+            return;
+        }
+        i = (i + 1) & (t->cap - 1);
+    }
+    memcpy(t->keys + i * t->n, ids, t->n * sizeof(uint32_t));
+    t->counts[i] = count;
+    if (++t->used * 10 > t->cap * 7)
+        ngram_table_grow(t);
+}
+
+// Add every n-gram of src to dst; both must share one Vocab.
+void ngram_table_merge(NgramTable *dst, const NgramTable *src) {
+    for (size_t s = 0; s < src->cap; s++) {
+        if (src->counts[s])
+            ngram_table_add(dst, src->keys + s * src->n, src->counts[s]);
+    }
+}
+
+void ngram_counter_init(NgramCounter *c, int n) {
+    vocab_init(&c->vocab);
+    ngram_table_init(&c->table, n);
+    c->filled = 0;
+    c->pushed = 0;
+}
+
+void ngram_counter_free(NgramCounter *c) {
+    vocab_free(&c->vocab);
+    ngram_table_free(&c->table);
+}
+
+// Start an independent piece of the stream: forget the history and record
+// a fresh head.
+void ngram_begin_part(NgramCounter *c) {
+    c->filled = 0;
+    c->pushed = 0;
+}
+
+void ngram_push_id(NgramCounter *c, uint32_t id) {
+    int n = c->table.n;
+    if (c->pushed < n - 1)
+        c->head[c->pushed] = id;
+    c->pushed++;
+
+    if (c->filled == n - 1) {
+        c->history[n - 1] = id;
+        ngram_table_add(&c->table, c->history, 1);
+        memmove(c->history, c->history + 1, (n - 1) * sizeof(uint32_t));
+    } else {
+        c->history[c->filled++] = id;
+    }
+}
+
+void ngram_push(NgramCounter *c, const char *word) {
+    ngram_push_id(c, vocab_intern(&c->vocab, word));
+}
+
+// Tokenizer callback: ctx is an NgramCounter.
+void ngram_emit(void *ctx, char *word) {
+    ngram_push((NgramCounter *)ctx, word);
+}
+
+// Continue dst's stream with a piece that was counted separately from an
+// empty history: count the n-grams that straddle the seam, then leave dst's
+// history where the piece ended. The piece's own n-grams are merged later.
+void ngram_stitch(NgramCounter *dst, const NgramCounter *part) {
+    int n = dst->table.n;
+    int head = part->pushed < n - 1 ? (int)part->pushed : n - 1;
+    for (int i = 0; i < head; i++)
+        ngram_push(dst, vocab_word(&part->vocab, part->head[i]));
+
+    if (part->pushed > n - 1) {
+        for (int i = 0; i < part->filled; i++)
+            dst->history[i] = vocab_intern(&dst->vocab, vocab_word(&part->vocab, part->history[i]));
+        dst->filled = part->filled;
+    }
+}
+
+// Add every n-gram of src to dst, re-interning src's words in dst's vocab.
+void ngram_counter_merge(NgramCounter *dst, const NgramCounter *src) {
+    int n = dst->table.n;
+    uint32_t *map = malloc((src->vocab.count ? src->vocab.count : 1) * sizeof(uint32_t));
+    for (uint32_t id = 0; id < src->vocab.count; id++)
+        map[id] = vocab_intern(&dst->vocab, vocab_word(&src->vocab, id));
+
+    uint32_t ids[NGRAM_MAX];
+    for (size_t s = 0; s < src->table.cap; s++) {
+        if (!src->table.counts[s])
+            continue;
+        for (int k = 0; k < n; k++)
+            ids[k] = map[src->table.keys[s * n + k]];
+        ngram_table_add(&dst->table, ids, src->table.counts[s]);
+    }
+    free(map);
+}
+
+// Flat form for sending between ranks: the vocab pool as-is, plus the
+// occupied table entries as packed ID tuples and counts.
+long long ngram_counter_flatten(const NgramCounter *c, uint32_t **keys_out, long long **counts_out) {
+    int n = c->table.n;
+    long long entries = (long long)c->table.used;
+    uint32_t *keys = malloc(entries ? entries * n * sizeof(uint32_t) : 1);
+    long long *counts = malloc(entries ? entries * sizeof(long long) : 1);
+    long long e = 0;
+    for (size_t s = 0; s < c->table.cap; s++) {
+        if (!c->table.counts[s])
+            continue;
+        memcpy(keys + e * n, c->table.keys + s * n, n * sizeof(uint32_t));
+        counts[e++] = c->table.counts[s];
+    }
+    *keys_out = keys;
+    *counts_out = counts;
+    return entries;
+}
+
+// Merge a flattened counter: `pool` holds `words` NUL-terminated words whose
+// positions are the IDs used in `keys`.
+void ngram_counter_merge_flat(NgramCounter *dst, const char *pool, uint32_t words,
+                              const uint32_t *keys, const long long *counts, long long entries) {
+    int n = dst->table.n;
+    uint32_t *map = malloc((words ? words : 1) * sizeof(uint32_t));
+    const char *p = pool;
+    for (uint32_t id = 0; id < words; id++) {
+        map[id] = vocab_intern(&dst->vocab, p);
+        p += strlen(p) + 1;
+    }
+
+    uint32_t ids[NGRAM_MAX];
+    for (long long e = 0; e < entries; e++) {
+        for (int k = 0; k < n; k++)
+            ids[k] = map[keys[e * n + k]];
+        ngram_table_add(&dst->table, ids, counts[e]);
+    }
+    free(map);
+}
+
+// Write "w1 w2 ...: count" lines, the n-gram form of the "word: count" output.
+void ngram_write_results(FILE *f, const NgramCounter *c) {
+    int n = c->table.n;
+    for (size_t s = 0; s < c->table.cap; s++) {
+        if (!c->table.counts[s])
+            continue;
+        for (int k = 0; k < n; k++)
+            fprintf(f, k ? " %s" : "%s", vocab_word(&c->vocab, c->table.keys[s * n + k]));
+        fprintf(f, ": %lld\n", c->table.counts[s]);
+    }
+}
+
+#endif
@@ -0,0 +1,167 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "doc_matrix.h"
+#include "ngram.h"
+#include "sort.h"
+
+// Command line shared by every implementation:
+//   <program> input.txt [--utf8] [--ngram N] [--shuffle] [--dynamic] [--sort count|alpha]
+//             [--stats FILE] [--stats-interval SECONDS]
+//             [--docs line|record|file] [--doc-separator SEP] [--matrix FILE]
+//             [--checkpoint PREFIX] [--checkpoint-interval SECONDS]
+// --shuffle, --dynamic and the checkpoint options only exist in the MPI
+// builds, which define OPTIONS_MPI before including this file; the other
+// builds reject them.
+typedef struct {
+    const char *input;
+    int utf8;
+    int ngram;      // 1 = single words, 2 = bigrams, ... up to NGRAM_MAX
+    int shuffle;    // MPI builds: stream partial counts to owning ranks
+    int dynamic;    // MPI builds: claim chunks on demand, not one fixed range
+    int sort;       // SORT_NONE, SORT_COUNT or SORT_ALPHA
+    const char *stats;      // JSON stats file, NULL for none
+    double stats_interval;  // seconds between RSS samples, 0 for none
+    DocSpec docs;           // per-document counts when docs.mode != DOCS_NONE
+    const char *matrix;     // term-document matrix file written in that mode
+    const char *checkpoint; // MPI builds: checkpoint files' prefix, NULL for none
+    double checkpoint_interval;
+} Options;
+
+#define DOC_MATRIX_DEFAULT "term_doc_matrix.bin"
+#define CHECKPOINT_INTERVAL_DEFAULT 300.0
+
+#ifdef OPTIONS_MPI
+#define OPTIONS_USAGE                                                              \
+    "input.txt [--utf8] [--ngram N] [--shuffle] [--dynamic] [--sort count|alpha] " \
+    "[--stats FILE] [--stats-interval SECONDS]\n"                                  \
+    "       [--docs line|record|file] [--doc-separator SEP] [--matrix FILE]\n"         \
+    "       [--checkpoint PREFIX] [--checkpoint-interval SECONDS]"
+#else
+#define OPTIONS_USAGE                                                       \
+    "input.txt [--utf8] [--ngram N] [--sort count|alpha] "                  \
+    "[--stats FILE] [--stats-interval SECONDS]\n"                           \
+    "       [--docs line|record|file] [--doc-separator SEP] [--matrix FILE]"
+#endif
+
+// Returns 0 on success, -1 (after printing the reason) on a bad command line.
+int parse_options(int argc, char *argv[], Options *opts) {
+    memset(opts, 0, sizeof(*opts));
+    opts->ngram = 1;
+    opts->matrix = DOC_MATRIX_DEFAULT;
+    opts->checkpoint_interval = CHECKPOINT_INTERVAL_DEFAULT;
+    const char *separator = NULL;
+    const char *mpi_only = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--utf8") == 0) {
+            opts->utf8 = 1;
+        } else if (strcmp(argv[i], "--shuffle") == 0) {
+            opts->shuffle = 1;
+            mpi_only = argv[i];
+        } else if (strcmp(argv[i], "--dynamic") == 0) {
+            opts->dynamic = 1;
+            mpi_only = argv[i];
+        } else if (strcmp(argv[i], "--sort") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "count") == 0) {
+                opts->sort = SORT_COUNT;
+            } else if (strcmp(argv[i], "alpha") == 0) {
+                opts->sort = SORT_ALPHA;
+            } else {
+                fprintf(stderr, "--sort must be count or alpha\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--ngram") == 0 && i + 1 < argc) {
+            opts->ngram = atoi(argv[++i]);
+            if (opts->ngram < 1 || opts->ngram > NGRAM_MAX) {
+                fprintf(stderr, "--ngram must be between 1 and %d\n", NGRAM_MAX);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+            opts->stats = argv[++i];
+        } else if (strcmp(argv[i], "--stats-interval") == 0 && i + 1 < argc) {
+            opts->stats_interval = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--docs") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "line") == 0) {
+                opts->docs.mode = DOCS_LINE;
+            } else if (strcmp(argv[i], "record") == 0) {
+                opts->docs.mode = DOCS_RECORD;
+            } else if (strcmp(argv[i], "file") == 0) {
+                opts->docs.mode = DOCS_FILE;
+            } else {
+                fprintf(stderr, "--docs must be line, record or file\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--doc-separator") == 0 && i + 1 < argc) {
+            separator = argv[++i];
+        } else if (strcmp(argv[i], "--matrix") == 0 && i + 1 < argc) {
+            opts->matrix = argv[++i];
+        } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+            mpi_only = argv[i];
+            opts->checkpoint = argv[++i];
+        } else if (strcmp(argv[i], "--checkpoint-interval") == 0 && i + 1 < argc) {
+            mpi_only = argv[i];
+            opts->checkpoint_interval = atof(argv[++i]);
+            if (opts->checkpoint_interval < 0) {
+                fprintf(stderr, "--checkpoint-interval must not be negative\n");
+                return -1;
+            }
+        } else if (argv[i][0] == '-' && argv[i][1] == '-') {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            return -1;
+        } else if (!opts->input) {
+            opts->input = argv[i];
+        } else {
+            fprintf(stderr, "Unexpected argument: %s\n", argv[i]);
+            return -1;
+        }
+    }
+
+#ifndef OPTIONS_MPI
+    if (mpi_only) {
+        fprintf(stderr, "%s is only supported by the MPI and Hybrid builds\n", mpi_only);
+        return -1;
+    }
+#else
+    (void)mpi_only;
+#endif
+    if (opts->docs.mode == DOCS_LINE) {
+        opts->docs.sep[0] = '\n';
+        opts->docs.sep_len = 1;
+    }
+    if (separator && opts->docs.mode != DOCS_RECORD) {
+        fprintf(stderr, "--doc-separator needs --docs record\n");
+        return -1;
+    }
+    if (opts->docs.mode == DOCS_RECORD) {
+        if (!separator) {
+            fprintf(stderr, "--docs record needs --doc-separator\n");
+            return -1;
+        }
+        if (doc_spec_set_separator(&opts->docs, separator) != 0)
+            return -1;
+    }
+    if (opts->docs.mode != DOCS_NONE && opts->ngram > 1) {
+        fprintf(stderr, "--docs counts single words and cannot be combined with --ngram\n");
+        return -1;
+    }
+    // The matrix always lists its terms alphabetically; --sort has nothing to order
+    if (opts->docs.mode != DOCS_NONE && opts->sort != SORT_NONE) {
+        fprintf(stderr, "--docs writes a matrix and cannot be combined with --sort\n");
+        return -1;
+    }
+    // A checkpoint holds a rank's word table, which n-grams, documents and
+    // shuffled counts do not go through
+    if (opts->checkpoint && (opts->ngram > 1 || opts->docs.mode != DOCS_NONE || opts->shuffle)) {
+        fprintf(stderr, "--checkpoint cannot be combined with --ngram, --docs or --shuffle\n");
+        return -1;
+    }
+    return opts->input ? 0 : -1;
+}
+
+#endif
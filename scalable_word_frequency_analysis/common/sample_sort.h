@@ -0,0 +1,220 @@
+#ifndef SAMPLE_SORT_H
+#define SAMPLE_SORT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mpi.h>
+
+#include "sort.h"
+#include "window_io.h"
+
+// Distributed sample sort for tables whose words are disjoint across ranks
+// (each rank holding the final counts of the words it owns). Every rank
+// sorts its own entries, rank 0 picks size - 1 splitters from a regular
+// sample of every rank's sorted run, and the ranks exchange entries so rank
+// r ends up with the r-th slice of the global order. Written in rank order,
+// the shards form one sorted file.
+
+// Records on the wire: count (8 bytes), length (4), word, NUL.
+static size_t packed_entry_size(const WordEntry *e) {
+    return sizeof(long long) + sizeof(uint32_t) + e->len + 1;
+}
+
+static size_t pack_entry(char *p, const WordEntry *e) {
+    memcpy(p, &e->count, sizeof(long long));
+    memcpy(p + 8, &e->len, sizeof(uint32_t));
+    memcpy(p + 12, e->word, e->len + 1);
+    return packed_entry_size(e);
+}
+
+// Entries pointing into buf, which must outlive them.
+static WordEntry *unpack_entries(const char *buf, size_t bytes, size_t *n_out) {
+    size_t n = 0;
+    for (size_t off = 0; off < bytes; n++) {
+        uint32_t len;
+        memcpy(&len, buf + off + 8, sizeof(uint32_t));
+        off += 13 + len;
+    }
+    WordEntry *e = malloc((n ? n : 1) * sizeof(WordEntry));
+    size_t off = 0;
+    for (size_t i = 0; i < n; i++) {
+        memcpy(&e[i].count, buf + off, sizeof(long long));
+        memcpy(&e[i].len, buf + off + 8, sizeof(uint32_t));
+        e[i].word = buf + off + 12;
+        off += 13 + e[i].len;
+    }
+    *n_out = n;
+    return e;
+}
+
+static WordEntry **entry_pointers(WordEntry *e, size_t n) {
+    WordEntry **a = malloc((n ? n : 1) * sizeof(WordEntry *));
+    for (size_t i = 0; i < n; i++)
+        a[i] = &e[i];
+    return a;
+}
+
+// First index of sorted a[0, n) that comes after key.
+static size_t upper_bound_entry(WordEntry **a, size_t n, const WordEntry *key, int order) {
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (compare_entries(a[mid], key, order) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Rank 0 gathers up to `size` evenly spaced entries of every rank's sorted
+// run, sorts them and broadcasts size - 1 splitters picked evenly from them.
+// Returns the packed splitters (none when every table is empty).
+static char *choose_splitters(WordEntry **sorted, size_t n, int order, int rank, int size, size_t *bytes_out) {
+    size_t samples = n < (size_t)size ? n : (size_t)size;
+    size_t sample_bytes = 0;
+    for (size_t i = 0; i < samples; i++)
+        sample_bytes += packed_entry_size(sorted[i * n / samples]);
+    char *sample_buf = malloc(sample_bytes ? sample_bytes : 1);
+    char *p = sample_buf;
+    for (size_t i = 0; i < samples; i++)
+        p += pack_entry(p, sorted[i * n / samples]);
+
+    int mine = (int)sample_bytes, total = 0;
+    int *sizes = malloc(size * sizeof(int));
+    int *displs = malloc(size * sizeof(int));
+    MPI_Gather(&mine, 1, MPI_INT, sizes, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (rank == 0) {
+        for (int r = 0; r < size; r++) {
+            displs[r] = total;
+            total += sizes[r];
+        }
+    }
+    char *all = malloc(total ? total : 1);
+    MPI_Gatherv(sample_buf, mine, MPI_BYTE, all, sizes, displs, MPI_BYTE, 0, MPI_COMM_WORLD);
+    free(sample_buf);
+    free(sizes);
+    free(displs);
+
+    long long split_bytes = 0;
+    char *splitters = NULL;
+    if (rank == 0) {
+        size_t m;
+        WordEntry *e = unpack_entries(all, total, &m);
+        WordEntry **a = entry_pointers(e, m);
+        sort_entries(a, m, order);
+        if (m > 0) {
+            for (int r = 1; r < size; r++)
+                split_bytes += packed_entry_size(a[(size_t)r * m / size]);
+        }
+        splitters = malloc(split_bytes ? split_bytes : 1);
+        p = splitters;
+        for (int r = 1; r < size && m > 0; r++)
+            p += pack_entry(p, a[(size_t)r * m / size]);
+        free(a);
+        free(e);
+    }
+    free(all);
+
+    MPI_Bcast(&split_bytes, 1, MPI_LONG_LONG, 0, MPI_COMM_WORLD);
+    if (rank != 0)
+        splitters = malloc(split_bytes ? split_bytes : 1);
+    MPI_Bcast(splitters, (int)split_bytes, MPI_BYTE, 0, MPI_COMM_WORLD);
+    *bytes_out = (size_t)split_bytes;
+    return splitters;
+}
+
+// Collective: sort the union of every rank's table and write it to filename
+// as "word: count" lines, with header (if any) at the top of rank 0's shard.
+// Returns -1 on every rank if the file could not be written.
+int write_sorted_shards(const char *filename, const WordTable *t, int order, const char *header) {
+    int rank, size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    WordEntry **sorted = sorted_entries(t, order);
+    size_t n = t->used;
+
+    size_t split_bytes, nsplit;
+    char *split_buf = choose_splitters(sorted, n, order, rank, size, &split_bytes);
+    WordEntry *splitters = unpack_entries(split_buf, split_bytes, &nsplit);
+
+    // Entries up to splitter r go to rank r; the rest go to the last rank
+    size_t *bound = malloc((size + 1) * sizeof(size_t));
+    bound[0] = 0;
+    for (int r = 0; r < size - 1; r++)
+        bound[r + 1] = (size_t)r < nsplit ? upper_bound_entry(sorted, n, &splitters[r], order) : n;
+    bound[size] = n;
+    for (int r = 1; r <= size; r++) {
+        if (bound[r] < bound[r - 1])
+            bound[r] = bound[r - 1];
+    }
+    free(splitters);
+    free(split_buf);
+
+    long long *send_bytes = calloc(size, sizeof(long long));
+    long long *recv_bytes = calloc(size, sizeof(long long));
+    size_t *send_off = malloc((size + 1) * sizeof(size_t));
+    size_t total_send = 0;
+    for (int r = 0; r < size; r++) {
+        send_off[r] = total_send;
+        for (size_t i = bound[r]; i < bound[r + 1]; i++)
+            send_bytes[r] += packed_entry_size(sorted[i]);
+        total_send += send_bytes[r];
+    }
+    char *send_buf = malloc(total_send ? total_send : 1);
+    char *p = send_buf;
+    for (size_t i = 0; i < n; i++)
+        p += pack_entry(p, sorted[i]);
+    free(sorted);
+    free(bound);
+
+    MPI_Alltoall(send_bytes, 1, MPI_LONG_LONG, recv_bytes, 1, MPI_LONG_LONG, MPI_COMM_WORLD);
+    size_t total_recv = 0;
+    size_t *recv_off = malloc((size + 1) * sizeof(size_t));
+    for (int r = 0; r < size; r++) {
+        recv_off[r] = total_recv;
+        total_recv += recv_bytes[r];
+    }
+    char *recv_buf = malloc(total_recv ? total_recv : 1);
+
+    // Pairwise exchange: at step k, send to rank + k and hear from rank - k
+    int phase = stats_phase;
+    stats_phase = STATS_PHASE_SORT;
+    memcpy(recv_buf + recv_off[rank], send_buf + send_off[rank], send_bytes[rank]);
+    for (int k = 1; k < size; k++) {
+        int dest = (rank + k) % size, src = (rank - k + size) % size;
+        sendrecv_large(send_buf + send_off[dest], send_bytes[dest], dest, recv_buf + recv_off[src], recv_bytes[src],
+                       src, 0, MPI_COMM_WORLD);
+    }
+    stats_phase = phase;
+    free(send_buf);
+    free(send_off);
+    free(recv_off);
+    free(send_bytes);
+    free(recv_bytes);
+
+    // Each source sent a sorted run; sort their union into this rank's slice
+    size_t m;
+    WordEntry *mine = unpack_entries(recv_buf, total_recv, &m);
+    WordEntry **slice = entry_pointers(mine, m);
+    sort_entries(slice, m, order);
+
+    size_t header_len = header ? strlen(header) : 0;
+    size_t cap = header_len + total_recv + m * 24 + 1;
+    char *text = malloc(cap);
+    memcpy(text, header ? header : "", header_len);
+    size_t len = header_len;
+    for (size_t i = 0; i < m; i++)
+        len += snprintf(text + len, cap - len, "%s: %lld\n", slice[i]->word, slice[i]->count);
+    free(slice);
+    free(mine);
+    free(recv_buf);
+
+    int rc = write_shards(filename, text, len);
+    free(text);
+    return rc;
+}
+
+#endif
@@ -0,0 +1,231 @@
+#ifndef SHUFFLE_H
+#define SHUFFLE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mpi.h>
+
+#include "window_io.h"
+#include "word_table.h"
+
+// Streaming shuffle for the MPI builds. Every word has an owning rank, picked
+// from its hash. While a rank tokenizes, it periodically flushes what it has
+// counted so far as one batch per owning rank, sent with MPI_Isend, and
+// merges the batches that other ranks have sent it in the meantime. When
+// parsing ends only the last partial batch is left to send, and each rank
+// holds the final counts of the words it owns.
+
+// Input bytes counted between two flushes. Bounds the size of a batch while
+// streaming; a flush of a larger table, such as the whole local table that
+// sorted output sends at the end, is cut into batches of at most
+// MAX_MSG_BYTES.
+#ifndef SHUFFLE_BATCH
+#define SHUFFLE_BATCH (4 * 1024 * 1024)
+#endif
+
+// Batches a rank may have in flight before it waits for some to be delivered
+#define SHUFFLE_MAX_INFLIGHT 64
+
+#define SHUFFLE_TAG 100
+
+typedef struct {
+    MPI_Request req;
+    char *buf;
+} ShuffleSend;
+
+typedef struct {
+    char *data;
+    size_t len, cap;
+} ShuffleBuffer;
+
+typedef struct {
+    int rank, size;
+    WordTable owned;            // final counts of the words this rank owns
+    ShuffleBuffer *out;         // batch being built for each rank
+    ShuffleSend inflight[SHUFFLE_MAX_INFLIGHT];
+    int ninflight;
+    int finished_peers;         // ranks whose last batch has arrived
+    long long batches_sent, bytes_sent;
+    long long batches_received, bytes_received;
+} Shuffle;
+
+void shuffle_init(Shuffle *sh) {
+    memset(sh, 0, sizeof(*sh));
+    MPI_Comm_rank(MPI_COMM_WORLD, &sh->rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &sh->size);
+    word_table_init(&sh->owned);
+    sh->out = calloc(sh->size, sizeof(ShuffleBuffer));
+}
+
+void shuffle_free(Shuffle *sh) {
+    word_table_free(&sh->owned);
+    for (int r = 0; r < sh->size; r++)
+        free(sh->out[r].data);
+    free(sh->out);
+}
+
+// The table places words by the low bits of the same 32-bit tag, so scramble
+// it before picking a rank; otherwise a rank's words would share low bits
+// and crowd into a fraction of its slots.
+static inline int shuffle_owner(uint32_t tag, int size) {
+    return (int)(((uint64_t)(uint32_t)(tag * 2654435761u) * (uint64_t)size) >> 32);
+}
+
+// A batch is a run of records: count (8 bytes), tag (4), length (4), word.
+static void shuffle_append(ShuffleBuffer *b, const WordEntry *e, uint32_t tag) {
+    size_t need = sizeof(long long) + 2 * sizeof(uint32_t) + e->len;
+    if (b->len + need > b->cap) {
+        b->cap = (b->len + need) * 2;
+        b->data = realloc(b->data, b->cap);
+    }
+    char *p = b->data + b->len;
+    memcpy(p, &e->count, sizeof(long long));
+    memcpy(p + 8, &tag, sizeof(uint32_t));
+    memcpy(p + 12, &e->len, sizeof(uint32_t));
+    memcpy(p + 16, e->word, e->len);
+    b->len += need;
+}
+
+static void shuffle_merge_batch(Shuffle *sh, const char *p, size_t len) {
+    const char *end = p + len;
+    while (p < end) {
+        long long count;
+        uint32_t tag, wl;
+        memcpy(&count, p, sizeof(long long));
+        memcpy(&tag, p + 8, sizeof(uint32_t));
+        memcpy(&wl, p + 12, sizeof(uint32_t));
+        word_table_add_hashed(&sh->owned, p + 16, wl, tag, count);
+        p += 16 + wl;
+    }
+}
+
+// Free the buffers of sends that have completed.
+static void shuffle_reap(Shuffle *sh) {
+    int kept = 0;
+    for (int i = 0; i < sh->ninflight; i++) {
+        int done;
+        MPI_Test(&sh->inflight[i].req, &done, MPI_STATUS_IGNORE);
+        if (done)
+            free(sh->inflight[i].buf);
+        else
+            sh->inflight[kept++] = sh->inflight[i];
+    }
+    sh->ninflight = kept;
+}
+
+// Merge every batch that has already arrived. An empty message marks the
+// sender's last batch; MPI keeps messages between two ranks in order, so it
+// is never overtaken by that rank's data.
+void shuffle_poll(Shuffle *sh) {
+    for (;;) {
+        int flag, bytes;
+        MPI_Status status;
+        MPI_Iprobe(MPI_ANY_SOURCE, SHUFFLE_TAG, MPI_COMM_WORLD, &flag, &status);
+        if (!flag)
+            break;
+        MPI_Get_count(&status, MPI_BYTE, &bytes);
+        char *buf = malloc(bytes ? bytes : 1);
+        MPI_Recv(buf, bytes, MPI_BYTE, status.MPI_SOURCE, SHUFFLE_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        if (bytes == 0) {
+            sh->finished_peers++;
+        } else {
+            stats_bytes_received[STATS_PHASE_SHUFFLE] += bytes;
+            shuffle_merge_batch(sh, buf, bytes);
+            sh->batches_received++;
+            sh->bytes_received += bytes;
+        }
+        free(buf);
+    }
+    shuffle_reap(sh);
+}
+
+// Hand buf to MPI. Ranks keep receiving while they wait for a free send
+// slot, so two ranks blocked on each other still make progress.
+static void shuffle_send(Shuffle *sh, char *buf, size_t len, int dest) {
+    while (sh->ninflight == SHUFFLE_MAX_INFLIGHT)
+        shuffle_poll(sh);
+    ShuffleSend *s = &sh->inflight[sh->ninflight++];
+    s->buf = buf;
+    MPI_Isend(buf, (int)len, MPI_BYTE, dest, SHUFFLE_TAG, MPI_COMM_WORLD, &s->req);
+    if (len > 0) {
+        stats_bytes_sent[STATS_PHASE_SHUFFLE] += len;
+        sh->batches_sent++;
+        sh->bytes_sent += len;
+    }
+}
+
+// Send the batch built for rank r, if any, and start a new one.
+static void shuffle_send_batch(Shuffle *sh, int r) {
+    ShuffleBuffer *b = &sh->out[r];
+    if (b->len == 0)
+        return;
+    shuffle_send(sh, b->data, b->len, r);
+    b->data = NULL;
+    b->len = b->cap = 0;
+}
+
+// Send the counts gathered in pending to their owners, then empty pending.
+// Words this rank owns go straight into its own table.
+void shuffle_flush(Shuffle *sh, WordTable *pending) {
+    // Room for one more record of the longest word
+    size_t batch_limit = MAX_MSG_BYTES - (sizeof(long long) + 2 * sizeof(uint32_t) + MAX_WORD_LEN);
+    for (size_t s = 0; s < pending->cap; s++) {
+        uint64_t slot = pending->slots[s];
+        if (!slot)
+            continue;
+        const WordEntry *e = word_table_entry(pending, (uint32_t)slot - 1);
+        uint32_t tag = (uint32_t)(slot >> 32);
+        int owner = shuffle_owner(tag, sh->size);
+        if (owner == sh->rank)
+            word_table_add_hashed(&sh->owned, e->word, e->len, tag, e->count);
+        else
+            shuffle_append(&sh->out[owner], e, tag);
+        if (sh->out[owner].len > batch_limit)
+            shuffle_send_batch(sh, owner);
+    }
+
+    for (int r = 0; r < sh->size; r++)
+        shuffle_send_batch(sh, r);
+
+    word_table_free(pending);
+    word_table_init(pending);
+    shuffle_poll(sh);
+}
+
+// Flush the last batch, tell every rank this one is done, and wait for the
+// others. Afterwards sh->owned holds the final counts of this rank's words.
+void shuffle_finish(Shuffle *sh, WordTable *pending) {
+    shuffle_flush(sh, pending);
+    for (int r = 0; r < sh->size; r++) {
+        if (r != sh->rank)
+            shuffle_send(sh, NULL, 0, r);
+    }
+    while (sh->finished_peers < sh->size - 1 || sh->ninflight > 0) {
+        if (sh->ninflight == 0) {
+            MPI_Status status;
+            MPI_Probe(MPI_ANY_SOURCE, SHUFFLE_TAG, MPI_COMM_WORLD, &status);
+        }
+        shuffle_poll(sh);
+    }
+}
+
+// Render a table as "word: count" lines, after an optional header.
+size_t format_table(const WordTable *t, const char *header, char **out) {
+    size_t header_len = header ? strlen(header) : 0;
+    size_t cap = header_len + 1;
+    for (size_t i = 0; i < t->used; i++)
+        cap += word_table_entry(t, i)->len + 24;
+
+    char *text = malloc(cap);
+    memcpy(text, header ? header : "", header_len);
+    size_t len = header_len;
+    for (size_t i = 0; i < t->used; i++) {
+        const WordEntry *e = word_table_entry(t, i);
+        len += snprintf(text + len, cap - len, "%s: %lld\n", e->word, e->count);
+    }
+    *out = text;
+    return len;
+}
+
+#endif
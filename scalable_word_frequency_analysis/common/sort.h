@@ -0,0 +1,115 @@
+#ifndef SORT_H
+#define SORT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ngram.h"
+#include "word_table.h"
+
+// Deterministic output order. Words are unique within a table, so either
+// order is total and the output no longer depends on thread count, rank
+// count or insertion order.
+enum {
+    SORT_NONE,      // table order, the default
+    SORT_COUNT,     // count descending, ties alphabetical
+    SORT_ALPHA,     // alphabetical (byte order, so code point order in UTF-8)
+};
+
+// Below this many entries a merge sort run is sorted with qsort, and only runs
+// above SORT_TASK_CUTOFF are split into OpenMP tasks.
+#define SORT_SERIAL_CUTOFF 1024
+#define SORT_TASK_CUTOFF (1 << 16)
+
+static inline int compare_entries(const WordEntry *a, const WordEntry *b, int order) {
+    if (order == SORT_COUNT && a->count != b->count)
+        return a->count < b->count ? 1 : -1;
+    return strcmp(a->word, b->word);
+}
+
+static int compare_count_qsort(const void *a, const void *b) {
+    return compare_entries(*(WordEntry *const *)a, *(WordEntry *const *)b, SORT_COUNT);
+}
+
+static int compare_alpha_qsort(const void *a, const void *b) {
+    return compare_entries(*(WordEntry *const *)a, *(WordEntry *const *)b, SORT_ALPHA);
+}
+
+static void merge_sort_run(WordEntry **a, WordEntry **tmp, size_t n, int order) {
+    if (n <= SORT_SERIAL_CUTOFF) {
+        qsort(a, n, sizeof(WordEntry *), order == SORT_COUNT ? compare_count_qsort : compare_alpha_qsort);
+        return;
+    }
+    size_t half = n / 2;
+#ifdef _OPENMP
+#pragma omp task if (n > SORT_TASK_CUTOFF)
+#endif
+    merge_sort_run(a, tmp, half, order);
+    merge_sort_run(a + half, tmp + half, n - half, order);
+#ifdef _OPENMP
+#pragma omp taskwait
+#endif
+
+    size_t i = 0, j = half, k = 0;
+    while (i < half && j < n)
+        tmp[k++] = compare_entries(a[i], a[j], order) <= 0 ? a[i++] : a[j++];
+    while (i < half)
+        tmp[k++] = a[i++];
+    while (j < n)
+        tmp[k++] = a[j++];
+    memcpy(a, tmp, n * sizeof(WordEntry *));
+}
+
+// Merge sort; built with -fopenmp the two halves of large runs are sorted as
+// parallel tasks.
+void sort_entries(WordEntry **a, size_t n, int order) {
+    WordEntry **tmp = malloc((n ? n : 1) * sizeof(WordEntry *));
+#ifdef _OPENMP
+#pragma omp parallel
+#pragma omp single
+#endif
+    merge_sort_run(a, tmp, n, order);
+    free(tmp);
+}
+
+// The entries of t in the given order. The caller frees the array.
+WordEntry **sorted_entries(const WordTable *t, int order) {
+    WordEntry **a = malloc((t->used ? t->used : 1) * sizeof(WordEntry *));
+    for (size_t i = 0; i < t->used; i++)
+        a[i] = word_table_entry(t, i);
+    sort_entries(a, t->used, order);
+    return a;
+}
+
+// Copy every n-gram into t under its "w1 w2 ..." text, so n-grams sort and
+// print exactly like single words.
+void ngram_counter_to_table(const NgramCounter *c, WordTable *t) {
+    int n = c->table.n;
+    char text[NGRAM_MAX * MAX_WORD_LEN];
+    for (size_t s = 0; s < c->table.cap; s++) {
+        if (!c->table.counts[s])
+            continue;
+        size_t len = 0;
+        for (int k = 0; k < n; k++) {
+            const char *w = vocab_word(&c->vocab, c->table.keys[s * n + k]);
+            size_t wl = strlen(w);
+            if (k)
+                text[len++] = ' ';
+            memcpy(text + len, w, wl);
+            len += wl;
+        }
+        text[len] = '\0';
+        word_table_add(t, text, c->table.counts[s]);
+    }
+}
+
+// Write the table to f in the given order, as "word: count" lines.
+void write_sorted_results(FILE *f, const WordTable *t, int order) {
+    WordEntry **a = sorted_entries(t, order);
+    for (size_t i = 0; i < t->used; i++)
+        fprintf(f, "%s: %lld\n", a[i]->word, a[i]->count);
+    free(a);
+}
+
+#endif
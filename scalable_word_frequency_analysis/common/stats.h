@@ -0,0 +1,218 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "word_table.h"
+
+// Run statistics written as JSON with --stats FILE: peak RSS, the size and
+// health of each word table, and (in the MPI builds) bytes moved per phase.
+// With --stats-interval SECONDS a sampler thread also records the resident
+// set size over time.
+
+#define STATS_PROBE_BUCKETS 16      // 1 .. 15 probes, then 16 or more
+#define STATS_CLUSTER_BUCKETS 20    // run lengths [2^i, 2^(i+1))
+
+// Bytes this rank sent and received, by phase of the run.
+enum { STATS_PHASE_GATHER, STATS_PHASE_SHUFFLE, STATS_PHASE_SORT, STATS_PHASES };
+const char *stats_phase_names[STATS_PHASES] = {"gather", "shuffle", "sort"};
+long long stats_bytes_sent[STATS_PHASES], stats_bytes_received[STATS_PHASES];
+int stats_phase = STATS_PHASE_GATHER;
+
+typedef struct {
+    char *data;
+    size_t len, cap;
+} StatsText;
+
+void stats_printf(StatsText *s, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+void stats_printf(StatsText *s, const char *fmt, ...) {
+    va_list ap;
+    for (;;) {
+        va_start(ap, fmt);
+        int n = vsnprintf(s->data + s->len, s->cap - s->len, fmt, ap);
+        va_end(ap);
+        if (n >= 0 && s->len + n < s->cap) {
+            s->len += n;
+            return;
+        }
+        s->cap = s->cap * 2 + n + 256;
+        s->data = realloc(s->data, s->cap);
+    }
+}
+
+typedef struct {
+    int enabled;
+    double interval;
+    struct timespec start;
+    StatsText tables;           // JSON objects, comma separated
+    pthread_t sampler;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int sampling, stop;
+    double *sample_time;
+    long *sample_rss_kb;
+    size_t nsamples, sample_cap;
+} RunStats;
+
+static double stats_elapsed(const RunStats *s) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - s->start.tv_sec) + (now.tv_nsec - s->start.tv_nsec) / 1e9;
+}
+
+long stats_peak_rss_kb(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+long stats_current_rss_kb(void) {
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+            resident = 0;
+        fclose(f);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void *stats_sample_loop(void *arg) {
+    RunStats *s = arg;
+    pthread_mutex_lock(&s->lock);
+    while (!s->stop) {
+        if (s->nsamples == s->sample_cap) {
+            s->sample_cap = s->sample_cap ? s->sample_cap * 2 : 64;
+            s->sample_time = realloc(s->sample_time, s->sample_cap * sizeof(double));
+            s->sample_rss_kb = realloc(s->sample_rss_kb, s->sample_cap * sizeof(long));
+        }
+        s->sample_time[s->nsamples] = stats_elapsed(s);
+        s->sample_rss_kb[s->nsamples++] = stats_current_rss_kb();
+
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        long long ns = until.tv_nsec + (long long)(s->interval * 1e9);
+        until.tv_sec += ns / 1000000000;
+        until.tv_nsec = ns % 1000000000;
+        while (!s->stop && pthread_cond_timedwait(&s->wake, &s->lock, &until) == 0)
+            ;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+// Does nothing unless enabled; samples RSS every interval seconds if > 0.
+void stats_start(RunStats *s, int enabled, double interval) {
+    memset(s, 0, sizeof(*s));
+    s->enabled = enabled;
+    s->interval = interval;
+    clock_gettime(CLOCK_MONOTONIC, &s->start);
+    if (!enabled || interval <= 0)
+        return;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->wake, NULL);
+    s->sampling = pthread_create(&s->sampler, NULL, stats_sample_loop, s) == 0;
+}
+
+// Record the size and health of a table. Probe lengths are the slots
+// visited to find each word (1 = its home slot); clusters are the runs of
+// occupied slots that a miss has to walk to the end of.
+void stats_add_table(RunStats *s, const char *name, const WordTable *t) {
+    if (!s->enabled)
+        return;
+    long long probes[STATS_PROBE_BUCKETS] = {0}, clusters[STATS_CLUSTER_BUCKETS] = {0};
+    long long total = 0;
+    size_t run = 0;
+    for (size_t i = 0; i <= t->cap; i++) {
+        uint64_t slot = i < t->cap ? t->slots[i] : 0;
+        if (!slot) {
+            if (run) {
+                int b = 0;
+                while (b < STATS_CLUSTER_BUCKETS - 1 && (run >> (b + 1)))
+                    b++;
+                clusters[b]++;
+            }
+            run = 0;
+            continue;
+        }
+        run++;
+        size_t home = (slot >> 32) & (t->cap - 1);
+        size_t dist = (i - home) & (t->cap - 1);
+        probes[dist < STATS_PROBE_BUCKETS - 1 ? dist : STATS_PROBE_BUCKETS - 1]++;
+        total += word_table_entry(t, (uint32_t)slot - 1)->count;
+    }
+
+    StatsText *o = &s->tables;
+    stats_printf(o, "%s{\"name\": \"%s\", \"unique_words\": %zu, \"total_words\": %lld, \"heap_bytes\": %zu, "
+                    "\"slots\": %zu, \"load_factor\": %.4f, \"probe_histogram\": [",
+                 o->len ? ", " : "", name, t->used, total, word_table_bytes(t), t->cap,
+                 t->cap ? (double)t->used / t->cap : 0.0);
+    for (int b = 0; b < STATS_PROBE_BUCKETS; b++)
+        stats_printf(o, b ? ", %lld" : "%lld", probes[b]);
+    stats_printf(o, "], \"cluster_histogram\": [");
+    for (int b = 0; b < STATS_CLUSTER_BUCKETS; b++)
+        stats_printf(o, b ? ", %lld" : "%lld", clusters[b]);
+    stats_printf(o, "]}");
+}
+
+// Stop sampling and render this process as one JSON object.
+void stats_finish(RunStats *s, int rank, StatsText *out) {
+    if (s->sampling) {
+        pthread_mutex_lock(&s->lock);
+        s->stop = 1;
+        pthread_cond_signal(&s->wake);
+        pthread_mutex_unlock(&s->lock);
+        pthread_join(s->sampler, NULL);
+        s->sampling = 0;
+    }
+
+    stats_printf(out, "{\"rank\": %d, \"elapsed_seconds\": %.6f, \"peak_rss_kb\": %ld, \"tables\": [%s], ", rank,
+                 stats_elapsed(s), stats_peak_rss_kb(), s->tables.data ? s->tables.data : "");
+    stats_printf(out, "\"bytes\": {");
+    for (int p = 0; p < STATS_PHASES; p++)
+        stats_printf(out, "%s\"%s\": {\"sent\": %lld, \"received\": %lld}", p ? ", " : "", stats_phase_names[p],
+                     stats_bytes_sent[p], stats_bytes_received[p]);
+    stats_printf(out, "}, \"rss_samples\": [");
+    for (size_t i = 0; i < s->nsamples; i++)
+        stats_printf(out, "%s[%.3f, %ld]", i ? ", " : "", s->sample_time[i], s->sample_rss_kb[i]);
+    stats_printf(out, "]}");
+
+    free(s->tables.data);
+    free(s->sample_time);
+    free(s->sample_rss_kb);
+    s->tables.data = NULL;
+    s->sample_time = NULL;
+    s->sample_rss_kb = NULL;
+}
+
+// Write {"program": ..., "ranks": [...]} from the already rendered objects.
+int stats_write_file(const char *filename, const char *program, const char *ranks_json) {
+    FILE *f = fopen(filename, "w");
+    if (!f) {
+        perror("Failed to open stats file");
+        return -1;
+    }
+    fprintf(f, "{\"program\": \"%s\", \"ranks\": [%s]}\n", program, ranks_json);
+    fclose(f);
+    return 0;
+}
+
+// Single-process builds: finish and write in one go.
+void stats_write(RunStats *s, const char *program, const char *filename) {
+    if (!s->enabled)
+        return;
+    StatsText text = {0};
+    stats_finish(s, 0, &text);
+    stats_write_file(filename, program, text.data);
+    free(text.data);
+}
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef TOKENIZE_H
+#define TOKENIZE_H
+
+#include <ctype.h>
+#include <stddef.h>
+
+#include "utf8.h"
+
+// Receives each word found by a range scanner, already lowercased.
+typedef void (*WordFn)(void *ctx, char *word);
+
+// Call emit(ctx, word) for every run of ASCII letters whose first byte lies
+// in buf[lo, hi). Bytes before lo and after hi are only context: a word
+// already running at lo belongs to the previous range, and a word starting
+// before hi is read to its end.
+void scan_words_in_range(const char *buf, size_t len, size_t lo, size_t hi, WordFn emit, void *ctx) {
+    char temp[MAX_WORD_LEN];
+    size_t i = lo;
+    if (i > 0 && isalpha((unsigned char)buf[i - 1])) {
+        while (i < len && isalpha((unsigned char)buf[i]))
+            i++;
+    }
+    while (i < hi) {
+        if (!isalpha((unsigned char)buf[i])) {
+            i++;
+            continue;
+        }
+        int j = 0;
+        while (i < len && isalpha((unsigned char)buf[i])) {
+            if (j < MAX_WORD_LEN - 1)
+                temp[j++] = tolower((unsigned char)buf[i]);
+            i++;
+        }
+        temp[j] = '\0';
+        emit(ctx, temp);
+    }
+}
+
+// Call emit(ctx, word) for every whitespace-separated token of buf[0, len)
+// with everything but letters dropped, as word_table_scan() splits
+// TOKEN_SPLIT_SPACE input: the same words, cut at MAX_WORD_LEN - 1 bytes,
+// and tokens without letters skipped.
+void scan_space_tokens(int utf8, const char *buf, size_t len, WordFn emit, void *ctx) {
+    const unsigned char *s = (const unsigned char *)buf;
+    char word[MAX_WORD_LEN];
+    int j = 0;
+    size_t i = 0;
+    while (i < len) {
+        if (isspace(s[i])) {
+            if (j > 0) {
+                word[j] = '\0';
+                emit(ctx, word);
+                j = 0;
+            }
+            i++;
+        } else if (s[i] < 0x80 || !utf8) {
+            if (s[i] < 0x80 && ascii_letter_fold[s[i]] && j < MAX_WORD_LEN - 1)
+                word[j++] = ascii_letter_fold[s[i]];
+            i++;
+        } else {
+            uint32_t cp;
+            i += utf8_decode(s + i, len - i, &cp);
+            if (unicode_is_letter(cp))
+                utf8_append_folded(word, &j, cp);
+        }
+    }
+    if (j > 0) {
+        word[j] = '\0';
+        emit(ctx, word);
+    }
+}
+
+void scan_range(int utf8, const char *buf, size_t len, size_t lo, size_t hi, WordFn emit, void *ctx) {
+    if (utf8)
+        utf8_scan_range(buf, len, lo, hi, emit, ctx);
+    else
+        scan_words_in_range(buf, len, lo, hi, emit, ctx);
+}
+
+#endif
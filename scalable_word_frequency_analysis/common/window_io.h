@@ -0,0 +1,256 @@
+#ifndef WINDOW_IO_H
+#define WINDOW_IO_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mpi.h>
+
+#include "stats.h"
+#include "tokenize.h"
+
+// Bytes of a rank's range read per MPI_File_read_at. Memory per rank is
+// bounded by this no matter how large the input file is.
+#ifndef READ_WINDOW
+#define READ_WINDOW (64 * 1024 * 1024)
+#endif
+
+// Context kept around every window so a word that straddles a window or
+// rank boundary is counted once, by the range its first byte falls in.
+#define WINDOW_LOOKBEHIND 4
+#define WINDOW_LOOKAHEAD MAX_WORD_LEN
+
+// Largest single message handed to MPI; int counts overflow at 2 GB.
+#ifndef MAX_MSG_BYTES
+#define MAX_MSG_BYTES (1 << 30)
+#endif
+
+typedef struct {
+    MPI_File file;
+    MPI_Offset file_size;
+    char *buf;
+} WindowReader;
+
+// One window of the file: bytes [lo, hi) of buf are the ones this window
+// owns, buf[0..len) also holds the surrounding context.
+typedef struct {
+    MPI_Offset start;
+    size_t lo, hi, len;
+} Window;
+
+int window_reader_open(WindowReader *r, const char *filename) {
+    if (MPI_File_open(MPI_COMM_WORLD, filename, MPI_MODE_RDONLY, MPI_INFO_NULL, &r->file) != MPI_SUCCESS) {
+        fprintf(stderr, "Error: Could not open input file %s\n", filename);
+        return -1;
+    }
+    MPI_File_get_size(r->file, &r->file_size);
+    r->buf = malloc((size_t)READ_WINDOW + WINDOW_LOOKBEHIND + WINDOW_LOOKAHEAD + 1);
+    if (!r->buf) {
+        fprintf(stderr, "Error: Could not allocate read window\n");
+        MPI_File_close(&r->file);
+        return -1;
+    }
+    return 0;
+}
+
+void window_reader_close(WindowReader *r) {
+    MPI_File_close(&r->file);
+    free(r->buf);
+}
+
+// Split [0, file_size) into `parts` contiguous ranges and return range `part`.
+void partition_range(MPI_Offset file_size, int part, int parts, MPI_Offset *begin, MPI_Offset *end) {
+    *begin = (MPI_Offset)((long double)file_size * part / parts);
+    *end = (MPI_Offset)((long double)file_size * (part + 1) / parts);
+}
+
+// Read the window of [pos, range_end) starting at pos, plus its context.
+// Returns 0 once the range is exhausted.
+int window_read(WindowReader *r, MPI_Offset pos, MPI_Offset range_end, Window *w) {
+    if (pos >= range_end)
+        return 0;
+
+    MPI_Offset owned_end = pos + READ_WINDOW < range_end ? pos + READ_WINDOW : range_end;
+    MPI_Offset read_start = pos > WINDOW_LOOKBEHIND ? pos - WINDOW_LOOKBEHIND : 0;
+    MPI_Offset read_end = owned_end + WINDOW_LOOKAHEAD < r->file_size ? owned_end + WINDOW_LOOKAHEAD : r->file_size;
+
+    MPI_Status status;
+    int got = 0;
+    MPI_File_read_at(r->file, read_start, r->buf, (int)(read_end - read_start), MPI_BYTE, &status);
+    MPI_Get_count(&status, MPI_BYTE, &got);
+    r->buf[got] = '\0';
+
+    w->start = pos;
+    w->lo = (size_t)(pos - read_start);
+    w->hi = (size_t)(owned_end - read_start);
+    w->len = (size_t)got;
+    if (w->hi > w->len)
+        w->hi = w->len;
+    return 1;
+}
+
+typedef struct {
+    WordFn emit;
+    void *ctx;
+    int wanted;
+} FollowingWords;
+
+static void take_following_word(void *ctx, char *word) {
+    FollowingWords *f = ctx;
+    if (f->wanted > 0) {
+        f->emit(f->ctx, word);
+        f->wanted--;
+    }
+}
+
+// Emit the first `wanted` words that start at or after pos, reading small
+// windows until they are found or the file ends. N-gram counting uses this
+// to finish the n-grams that begin in a range but end in the next one.
+void scan_following_words(WindowReader *r, MPI_Offset pos, int wanted, int utf8, WordFn emit, void *ctx) {
+    FollowingWords f = {emit, ctx, wanted};
+    Window w;
+    while (f.wanted > 0) {
+        MPI_Offset end = pos + 4096 < r->file_size ? pos + 4096 : r->file_size;
+        if (!window_read(r, pos, end, &w))
+            break;
+        scan_range(utf8, r->buf, w.len, w.lo, w.hi, take_following_word, &f);
+        pos += w.hi - w.lo;
+    }
+}
+
+// Point-to-point transfers split into MAX_MSG_BYTES pieces so buffers past
+// 2 GB never hit the int count limit.
+void send_large(const void *data, size_t bytes, int dest, int tag, MPI_Comm comm) {
+    const char *p = data;
+    stats_bytes_sent[stats_phase] += bytes;
+    do {
+        int piece = bytes > MAX_MSG_BYTES ? MAX_MSG_BYTES : (int)bytes;
+        MPI_Send(p, piece, MPI_BYTE, dest, tag, comm);
+        p += piece;
+        bytes -= piece;
+    } while (bytes > 0);
+}
+
+void recv_large(void *data, size_t bytes, int src, int tag, MPI_Comm comm) {
+    char *p = data;
+    stats_bytes_received[stats_phase] += bytes;
+    do {
+        int piece = bytes > MAX_MSG_BYTES ? MAX_MSG_BYTES : (int)bytes;
+        MPI_Recv(p, piece, MPI_BYTE, src, tag, comm, MPI_STATUS_IGNORE);
+        p += piece;
+        bytes -= piece;
+    } while (bytes > 0);
+}
+
+void bcast_large(void *data, size_t bytes, int root, MPI_Comm comm) {
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    if (rank == root)
+        stats_bytes_sent[stats_phase] += bytes;
+    else
+        stats_bytes_received[stats_phase] += bytes;
+    char *p = data;
+    while (bytes > 0) {
+        int piece = bytes > MAX_MSG_BYTES ? MAX_MSG_BYTES : (int)bytes;
+        MPI_Bcast(p, piece, MPI_BYTE, root, comm);
+        p += piece;
+        bytes -= piece;
+    }
+}
+
+// Send one buffer to dest while receiving another from src, in
+// MAX_MSG_BYTES pieces; either side may be empty. Once one side runs out it
+// talks to MPI_PROC_NULL, so each peer sees exactly the pieces it expects.
+void sendrecv_large(const void *send, size_t send_bytes, int dest, void *recv, size_t recv_bytes, int src, int tag,
+                    MPI_Comm comm) {
+    const char *s = send;
+    char *r = recv;
+    stats_bytes_sent[stats_phase] += send_bytes;
+    stats_bytes_received[stats_phase] += recv_bytes;
+    while (send_bytes > 0 || recv_bytes > 0) {
+        int out = send_bytes > MAX_MSG_BYTES ? MAX_MSG_BYTES : (int)send_bytes;
+        int in = recv_bytes > MAX_MSG_BYTES ? MAX_MSG_BYTES : (int)recv_bytes;
+        MPI_Sendrecv(s, out, MPI_BYTE, out ? dest : MPI_PROC_NULL, tag, r, in, MPI_BYTE, in ? src : MPI_PROC_NULL, tag,
+                     comm, MPI_STATUS_IGNORE);
+        s += out;
+        r += in;
+        send_bytes -= out;
+        recv_bytes -= in;
+    }
+}
+
+// Collectively write every rank's bytes into one file, rank 0's shard first
+// and each following rank's right after it. Replaces any existing file.
+// Returns -1 on every rank if any rank's write failed or came up short.
+int write_shards(const char *filename, const char *data, size_t len) {
+    MPI_File file;
+    if (MPI_File_open(MPI_COMM_WORLD, filename, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &file) != MPI_SUCCESS) {
+        fprintf(stderr, "Error: Could not open file %s for writing results.\n", filename);
+        return -1;
+    }
+    int failed = MPI_File_set_size(file, 0) != MPI_SUCCESS;
+
+    long long mine = (long long)len, offset = 0;
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Exscan(&mine, &offset, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+    if (rank == 0)
+        offset = 0;
+
+    while (!failed && len > 0) {
+        int piece = len > MAX_MSG_BYTES ? MAX_MSG_BYTES : (int)len;
+        MPI_Status status;
+        int written = 0;
+        if (MPI_File_write_at(file, offset, data, piece, MPI_BYTE, &status) != MPI_SUCCESS ||
+            MPI_Get_count(&status, MPI_BYTE, &written) != MPI_SUCCESS || written != piece)
+            failed = 1;
+        data += piece;
+        offset += piece;
+        len -= piece;
+    }
+    if (MPI_File_close(&file) != MPI_SUCCESS)
+        failed = 1;
+
+    int any_failed;
+    MPI_Allreduce(&failed, &any_failed, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    if (failed)
+        fprintf(stderr, "Error: Rank %d could not write its results to %s.\n", rank, filename);
+    return any_failed ? -1 : 0;
+}
+
+// Collective: gather every rank's stats object on rank 0 and write them to
+// filename as one JSON document.
+void stats_write_ranks(RunStats *s, const char *program, const char *filename) {
+    if (!s->enabled)
+        return;
+    int rank, size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    StatsText mine = {0};
+    if (rank != 0)
+        stats_printf(&mine, ", ");
+    stats_finish(s, rank, &mine);
+    int len = (int)mine.len, total = 0;
+    int *lens = malloc(size * sizeof(int));
+    int *displs = malloc(size * sizeof(int));
+    MPI_Gather(&len, 1, MPI_INT, lens, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (rank == 0) {
+        for (int r = 0; r < size; r++) {
+            displs[r] = total;
+            total += lens[r];
+        }
+    }
+    char *all = malloc(total + 1);
+    MPI_Gatherv(mine.data, len, MPI_CHAR, all, lens, displs, MPI_CHAR, 0, MPI_COMM_WORLD);
+    if (rank == 0) {
+        all[total] = '\0';
+        stats_write_file(filename, program, all);
+    }
+    free(all);
+    free(lens);
+    free(displs);
+    free(mine.data);
+}
+
+#endif
@@ -0,0 +1,353 @@
+#ifndef WORD_TABLE_H
+#define WORD_TABLE_H
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "utf8.h"
+
+// Word counting table plus the fused scan kernel that feeds it. The kernel
+// lowercases, hashes and finds word boundaries in one pass over the input;
+// the table is probed on (hash, length) before any byte compare, and a word's
+// bytes are only copied when it is first seen.
+//
+// Memory layout: a slot is 8 bytes, the low 32 bits of the word's hash next
+// to its entry index. Entries are 24-byte records bump-allocated in pages,
+// and word bytes are packed back to back in a string arena, so a new word
+// costs no malloc and a whole table is released in a handful of frees.
+
+#define ENTRY_PAGE_SHIFT 12
+#define ENTRY_PAGE_SIZE (1 << ENTRY_PAGE_SHIFT)
+
+typedef struct {
+    long long count;
+    const char *word;   // NUL-terminated, in the table's string arena
+    uint32_t len;
+} WordEntry;
+
+typedef struct {
+    uint64_t *slots;    // (hash << 32) | (entry index + 1), 0 = empty
+    size_t cap;         // power of two
+    size_t used;        // entries, also the next entry index
+    WordEntry **pages;  // entry arena, ENTRY_PAGE_SIZE entries per page
+    size_t npages;
+    Arena strings;
+} WordTable;
+
+// How a range is split into words.
+enum {
+    // Whitespace-separated tokens with everything but letters dropped
+    // (Serial, OpenMP).
+    TOKEN_SPLIT_SPACE,
+    // Runs of letters; any other character ends the word (MPI, Hybrid).
+    TOKEN_SPLIT_NONLETTER,
+};
+
+static inline uint64_t hash_mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+#define WORD_HASH_SEED 0x9e3779b97f4a7c15ULL
+
+// Bytes are packed into a 64-bit accumulator and mixed into the hash eight
+// at a time, so the kernel pays one multiply chain per 8 bytes, not per byte.
+static inline uint64_t word_hash_step(uint64_t h, uint64_t acc) {
+    return hash_mix(h ^ acc) + WORD_HASH_SEED;
+}
+
+static inline uint64_t word_hash_finish(uint64_t h, uint64_t acc, uint32_t len) {
+    return hash_mix(h ^ acc ^ ((uint64_t)len << 56));
+}
+
+// Same hash the scan kernel computes incrementally.
+uint64_t word_hash(const char *word, uint32_t len) {
+    uint64_t h = WORD_HASH_SEED, acc = 0;
+    uint32_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        for (int k = 0; k < 8; k++)
+            acc = (acc << 8) | (unsigned char)word[i + k];
+        h = word_hash_step(h, acc);
+        acc = 0;
+    }
+    for (; i < len; i++)
+        acc = (acc << 8) | (unsigned char)word[i];
+    return word_hash_finish(h, acc, len);
+}
+
+void word_table_init(WordTable *t) {
+    t->cap = 1024;
+    t->used = 0;
+    t->slots = calloc(t->cap, sizeof(uint64_t));
+    t->pages = NULL;
+    t->npages = 0;
+    arena_init(&t->strings);
+}
+
+// Release the slots, every entry page and the string arena at once.
+void word_table_free(WordTable *t) {
+    for (size_t p = 0; p < t->npages; p++)
+        free(t->pages[p]);
+    free(t->pages);
+    free(t->slots);
+    arena_release(&t->strings);
+}
+
+static inline WordEntry *word_table_entry(const WordTable *t, size_t index) {
+    return &t->pages[index >> ENTRY_PAGE_SHIFT][index & (ENTRY_PAGE_SIZE - 1)];
+}
+
+static WordEntry *word_table_new_entry(WordTable *t) {
+    if ((t->used & (ENTRY_PAGE_SIZE - 1)) == 0) {
+        t->pages = realloc(t->pages, (t->npages + 1) * sizeof(WordEntry *));
+        t->pages[t->npages++] = malloc(ENTRY_PAGE_SIZE * sizeof(WordEntry));
+    }
+    return word_table_entry(t, t->used);
+}
+
+static void word_table_grow(WordTable *t) {
+    size_t cap = t->cap * 2;
+    uint64_t *slots = calloc(cap, sizeof(uint64_t));
+    for (size_t s = 0; s < t->cap; s++) {
+        if (!t->slots[s])
+            continue;
+        size_t i = (t->slots[s] >> 32) & (cap - 1);
+        while (slots[i])
+            i = (i + 1) & (cap - 1);
+        slots[i] = t->slots[s];
+    }
+    free(t->slots);
+    t->slots = slots;
+    t->cap = cap;
+}
+
+// Add count to a word whose hash is already known and return its entry
+// index. Only the low 32 bits of the hash are kept, which is plenty to
+// place and filter up to 2^32 words.
+size_t word_table_add_hashed(WordTable *t, const char *word, uint32_t len, uint64_t hash, long long count) {
+    uint32_t tag = (uint32_t)hash;
+    size_t i = tag & (t->cap - 1);
+    uint64_t slot;
+    while ((slot = t->slots[i])) {
+        if ((uint32_t)(slot >> 32) == tag) {
+            WordEntry *e = word_table_entry(t, (uint32_t)slot - 1);
+            if (e->len == len && memcmp(e->word, word, len) == 0) {
+                e->count += count;
+                return (uint32_t)slot - 1;
+            }
+        }
+        i = (i + 1) & (t->cap - 1);
+    }
+
+    size_t index = t->used;
+    WordEntry *e = word_table_new_entry(t);
+    e->count = count;
+    e->len = len;
+    e->word = arena_strdup(&t->strings, word, len);
+    t->slots[i] = ((uint64_t)tag << 32) | (uint64_t)(index + 1);
+    if (++t->used * 10 > t->cap * 7)
+        word_table_grow(t);
+    return index;
+}
+
+// Entry index of a word, or -1 if the table does not hold it.
+long long word_table_find(const WordTable *t, const char *word, uint32_t len, uint64_t hash) {
+    uint32_t tag = (uint32_t)hash;
+    size_t i = tag & (t->cap - 1);
+    uint64_t slot;
+    while ((slot = t->slots[i])) {
+        if ((uint32_t)(slot >> 32) == tag) {
+            const WordEntry *e = word_table_entry(t, (uint32_t)slot - 1);
+            if (e->len == len && memcmp(e->word, word, len) == 0)
+                return (uint32_t)slot - 1;
+        }
+        i = (i + 1) & (t->cap - 1);
+    }
+    return -1;
+}
+
+void word_table_add(WordTable *t, const char *word, long long count) {
+    uint32_t len = (uint32_t)strlen(word);
+    word_table_add_hashed(t, word, len, word_hash(word, len), count);
+}
+
+// Add every word of src to dst, reusing the hashes kept in src's slots.
+void word_table_merge(WordTable *dst, const WordTable *src) {
+    for (size_t s = 0; s < src->cap; s++) {
+        uint64_t slot = src->slots[s];
+        if (!slot)
+            continue;
+        const WordEntry *e = word_table_entry(src, (uint32_t)slot - 1);
+        word_table_add_hashed(dst, e->word, e->len, slot >> 32, e->count);
+    }
+}
+
+// Heap bytes held by the table: slots, entry pages and string arena.
+size_t word_table_bytes(const WordTable *t) {
+    return t->cap * sizeof(uint64_t) + t->npages * (ENTRY_PAGE_SIZE * sizeof(WordEntry) + sizeof(WordEntry *)) +
+           t->strings.reserved;
+}
+
+// Pack a table into NUL-separated words and a parallel array of counts.
+long long flatten_table(const WordTable *table, char **words_out, size_t *words_bytes, long long **counts_out) {
+    long long n = (long long)table->used;
+    size_t bytes = 0;
+    for (size_t i = 0; i < table->used; i++)
+        bytes += word_table_entry(table, i)->len + 1;
+
+    char *words = malloc(bytes ? bytes : 1);
+    long long *counts = malloc(n ? n * sizeof(long long) : 1);
+    char *p = words;
+    for (size_t i = 0; i < table->used; i++) {
+        const WordEntry *entry = word_table_entry(table, i);
+        memcpy(p, entry->word, entry->len + 1);
+        p += entry->len + 1;
+        counts[i] = entry->count;
+    }
+
+    *words_out = words;
+    *words_bytes = bytes;
+    *counts_out = counts;
+    return n;
+}
+
+// Does the token running into s[i] continue at s[i]? Only used to skip the
+// tail of a token that belongs to the previous range, so it can be slow.
+static int token_continues_at(const unsigned char *s, size_t len, size_t i, int mode, int utf8, size_t *step) {
+    *step = 1;
+    if (s[i] < 0x80 || !utf8) {
+        if (mode == TOKEN_SPLIT_SPACE)
+            return !isspace(s[i]);
+        return s[i] < 0x80 && ascii_letter_fold[s[i]];
+    }
+    uint32_t cp;
+    *step = utf8_decode(s + i, len - i, &cp);
+    return mode == TOKEN_SPLIT_SPACE || unicode_is_letter(cp);
+}
+
+static int token_before(const unsigned char *s, size_t i, int mode, int utf8) {
+    if (i == 0)
+        return 0;
+    if (mode == TOKEN_SPLIT_SPACE)
+        return !isspace(s[i - 1]);
+    if (utf8)
+        return utf8_letter_before(s, i);
+    return s[i - 1] < 0x80 && ascii_letter_fold[s[i - 1]];
+}
+
+// The fused kernel: count every word whose token starts in buf[lo, hi) into
+// t and return how many were counted. Bytes before lo and after hi are only
+// context, exactly as for scan_words_in_range(). Words are cut at
+// MAX_WORD_LEN - 1 bytes.
+long long word_table_scan(WordTable *t, const char *buf, size_t len, size_t lo, size_t hi, int mode, int utf8) {
+    const unsigned char *s = (const unsigned char *)buf;
+    char word[MAX_WORD_LEN];
+    uint32_t wl = 0;
+    uint64_t h = 0, acc = 0;
+    int k = 0, in_token = 0;
+    long long counted = 0;
+    size_t i = lo;
+
+    // A code point or token already running at lo belongs to the previous range
+    if (utf8) {
+        while (i < len && utf8_is_continuation(s[i]))
+            i++;
+    }
+    if (token_before(s, i, mode, utf8)) {
+        size_t step;
+        while (i < len && token_continues_at(s, len, i, mode, utf8, &step))
+            i += step;
+    }
+
+#define START_TOKEN()                   \
+    do {                                \
+        if (i >= hi)                    \
+            goto done;                  \
+        in_token = 1;                   \
+        wl = 0;                         \
+        h = WORD_HASH_SEED;             \
+        acc = 0;                        \
+        k = 0;                          \
+    } while (0)
+
+#define APPEND_BYTE(b)                          \
+    do {                                        \
+        word[wl++] = (char)(b);                 \
+        acc = (acc << 8) | (b);                 \
+        if (++k == 8) {                         \
+            h = word_hash_step(h, acc);         \
+            acc = 0;                            \
+            k = 0;                              \
+        }                                       \
+    } while (0)
+
+#define END_TOKEN()                                                              \
+    do {                                                                         \
+        if (wl > 0) {                                                            \
+            word_table_add_hashed(t, word, wl, word_hash_finish(h, acc, wl), 1); \
+            counted++;                                                           \
+        }                                                                        \
+        in_token = 0;                                                            \
+    } while (0)
+
+    while (i < len) {
+        unsigned char c = s[i];
+        if (c < 0x80 || !utf8) {
+            unsigned char f = c < 0x80 ? ascii_letter_fold[c] : 0;
+            if (f) {
+                if (!in_token)
+                    START_TOKEN();
+                if (wl < MAX_WORD_LEN - 1)
+                    APPEND_BYTE(f);
+            } else if (mode == TOKEN_SPLIT_NONLETTER || isspace(c)) {
+                if (in_token)
+                    END_TOKEN();
+                else if (i >= hi)
+                    break;
+            } else if (!in_token) {
+                START_TOKEN();
+            }
+            i++;
+            continue;
+        }
+
+        // Multibyte sequence: decode, fold and re-encode before hashing
+        uint32_t cp;
+        int n = utf8_decode(s + i, len - i, &cp);
+        if (unicode_is_letter(cp)) {
+            if (!in_token)
+                START_TOKEN();
+            char enc[4];
+            int m = utf8_encode(unicode_fold(cp), enc);
+            if (wl + m <= MAX_WORD_LEN - 1) {
+                for (int b = 0; b < m; b++)
+                    APPEND_BYTE((unsigned char)enc[b]);
+            }
+        } else if (mode == TOKEN_SPLIT_NONLETTER) {
+            if (in_token)
+                END_TOKEN();
+            else if (i >= hi)
+                break;
+        } else if (!in_token) {
+            START_TOKEN();
+        }
+        i += n;
+    }
+    if (in_token)
+        END_TOKEN();
+done:
+    return counted;
+
+#undef START_TOKEN
+#undef APPEND_BYTE
+#undef END_TOKEN
+}
+
+#endif
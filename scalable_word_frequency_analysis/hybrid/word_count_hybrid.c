@@ -1,64 +1,129 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
 #include <mpi.h>
 #include <omp.h>
 
 #define MAX_WORD_LEN 100
-#define HASH_SIZE 10007
-
-typedef struct Word
+#define OPTIONS_MPI
+
+#include "../common/checkpoint.h"
+#include "../common/chunk_queue.h"
+#include "../common/doc_matrix_mpi.h"
+#include "../common/options.h"
+#include "../common/sample_sort.h"
+#include "../common/shuffle.h"
+#include "../common/stats.h"
+#include "../common/window_io.h"
+#include "../common/word_table.h"
+
+// Ship an n-gram counter to rank 0: its vocab pool, then the n-grams as
+// packed ID tuples that rank 0 maps onto its own vocab.
+void send_ngrams(const NgramCounter *c)
 {
-    char word[MAX_WORD_LEN];
-    int count;
-    struct Word *next;
-} Word;
+    uint32_t *keys;
+    long long *counts;
+    long long entries = ngram_counter_flatten(c, &keys, &counts);
+    long long header[3] = {entries, c->vocab.count, (long long)c->vocab.pool_len};
+    MPI_Send(header, 3, MPI_LONG_LONG, 0, 0, MPI_COMM_WORLD);
+    send_large(c->vocab.pool, c->vocab.pool_len, 0, 1, MPI_COMM_WORLD);
+    send_large(keys, entries * c->table.n * sizeof(uint32_t), 0, 2, MPI_COMM_WORLD);
+    send_large(counts, entries * sizeof(long long), 0, 3, MPI_COMM_WORLD);
+    free(keys);
+    free(counts);
+}
 
-int hash(char *word)
+void recv_ngrams(NgramCounter *c, int src)
 {
-    int h = 0;
-    for (int i = 0; word[i]; i++)
-    {
-        h = (h * 31 + word[i]) % HASH_SIZE;
-    }
-    return h;
+    long long header[3];
+    MPI_Recv(header, 3, MPI_LONG_LONG, src, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    long long entries = header[0];
+    size_t pool_len = (size_t)header[2];
+
+    char *pool = malloc(pool_len ? pool_len : 1);
+    uint32_t *keys = malloc(entries ? entries * c->table.n * sizeof(uint32_t) : 1);
+    long long *counts = malloc(entries ? entries * sizeof(long long) : 1);
+    recv_large(pool, pool_len, src, 1, MPI_COMM_WORLD);
+    recv_large(keys, entries * c->table.n * sizeof(uint32_t), src, 2, MPI_COMM_WORLD);
+    recv_large(counts, entries * sizeof(long long), src, 3, MPI_COMM_WORLD);
+
+    ngram_counter_merge_flat(c, pool, (uint32_t)header[1], keys, counts, entries);
+    free(pool);
+    free(keys);
+    free(counts);
 }
 
-void insert_word(Word **table, char *word, int count)
+// Count the documents of every range this rank is given into one row
+// buffer per thread. The threads split each window; afterwards the document
+// each thread left open is read on to its separator, within the window
+// first and past it only if need be. In file mode the ranks take turns
+// through the list of files and the threads share each rank's turns.
+void count_documents(DocRows *rows, int num_threads, const Options *opts, WindowReader *reader, ChunkQueue *queue)
 {
-    int index = hash(word);
-    Word *entry = table[index];
-
-    while (entry)
+    if (opts->docs.mode == DOCS_FILE)
     {
-        if (strcmp(entry->word, word) == 0)
-        {
-            entry->count += count;
+        int rank, size;
+        MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+        MPI_Comm_size(MPI_COMM_WORLD, &size);
+        char **paths;
+        size_t n;
+        if (doc_read_list(opts->input, &paths, &n) != 0)
             return;
-        }
-        entry = entry->next;
+#pragma omp parallel for schedule(dynamic)
+        for (size_t i = rank; i < n; i += size)
+            doc_rows_add_file(&rows[omp_get_thread_num()], paths[i], i);
+        doc_free_list(paths, n);
+        return;
     }
 
-    Word *new_word = (Word *)malloc(sizeof(Word));
-    strcpy(new_word->word, word);
-    new_word->count = count;
-    new_word->next = table[index];
-    table[index] = new_word;
-}
-
-void clean_word(char *word)
-{
-    int j = 0;
-    for (int i = 0; word[i]; i++)
+    size_t *slice_hi = malloc(num_threads * sizeof(size_t));
+    MPI_Offset range_begin, range_end;
+    while (chunk_queue_next(queue, &range_begin, &range_end))
     {
-        if (isalpha(word[i]))
-            word[j++] = tolower(word[i]);
+        Window w;
+        for (MPI_Offset pos = range_begin; window_read(reader, pos, range_end, &w); pos += w.hi - w.lo)
+        {
+            for (int t = 0; t < num_threads; t++)
+                slice_hi[t] = 0;
+#pragma omp parallel
+            {
+                int tid = omp_get_thread_num();
+                int nthreads = omp_get_num_threads();
+                size_t owned = w.hi - w.lo;
+                size_t lo = w.lo + owned * tid / nthreads;
+                size_t hi = w.lo + owned * (tid + 1) / nthreads;
+                if (lo < hi)
+                {
+                    MPI_Offset start = w.start + (MPI_Offset)(lo - w.lo);
+                    doc_rows_begin_part(&rows[tid], start, start == 0);
+                    doc_rows_scan_window(&rows[tid], reader, &w, lo, hi, 0);
+                    slice_hi[tid] = hi;
+                }
+            }
+
+            int past_window = 0;
+            for (int t = 0; t < num_threads; t++)
+            {
+                if (slice_hi[t] && !doc_rows_scan_window(&rows[t], reader, &w, slice_hi[t], w.hi, 1))
+                    past_window = 1;
+            }
+            // Reading on replaces the window, so it comes last
+            for (int t = 0; t < num_threads && past_window; t++)
+            {
+                if (slice_hi[t] && rows[t].open)
+                    doc_rows_finish_range(&rows[t], reader, w.start + (MPI_Offset)(w.hi - w.lo));
+            }
+            for (int t = 0; t < num_threads; t++)
+            {
+                if (slice_hi[t])
+                    doc_rows_end_part(&rows[t]);
+            }
+        }
     }
-    word[j] = '\0';
+    free(slice_hi);
 }
 
-void save_results(Word **table, const char *filename, double exec_time)
+void save_results(const WordTable *table, const NgramCounter *ngrams, const char *filename, double exec_time, int sort)
 {
     FILE *f = fopen(filename, "w");
     if (!f)
@@ -66,14 +131,25 @@ void save_results(Word **table, const char *filename, double exec_time)
 
     fprintf(f, "Execution Time: %.4f seconds\n\n", exec_time);
 
-    for (int i = 0; i < HASH_SIZE; i++)
+    // N-grams sort as their "w1 w2" text
+    if (sort != SORT_NONE)
     {
-        Word *entry = table[i];
-        while (entry)
-        {
-            fprintf(f, "%s: %d\n", entry->word, entry->count);
-            entry = entry->next;
-        }
+        WordTable text_table;
+        word_table_init(&text_table);
+        if (ngrams)
+            ngram_counter_to_table(ngrams, &text_table);
+        write_sorted_results(f, ngrams ? &text_table : table, sort);
+        word_table_free(&text_table);
+        fclose(f);
+        return;
+    }
+    if (ngrams)
+        ngram_write_results(f, ngrams);
+
+    for (size_t i = 0; table && i < table->used; i++)
+    {
+        WordEntry *entry = word_table_entry(table, i);
+        fprintf(f, "%s: %lld\n", entry->word, entry->count);
     }
     fclose(f);
 }
@@ -87,170 +163,291 @@ int main(int argc, char *argv[])
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
     MPI_Comm_size(MPI_COMM_WORLD, &size);
 
-    if (argc < 2)
+    Options opts;
+    if (parse_options(argc, argv, &opts) != 0)
     {
         if (rank == 0)
-            printf("Usage: %s input.txt\n", argv[0]);
+            printf("Usage: %s " OPTIONS_USAGE "\n", argv[0]);
         MPI_Finalize();
         return 1;
     }
 
-    char *filename = argv[1];
-    MPI_File file;
-    MPI_File_open(MPI_COMM_WORLD, filename, MPI_MODE_RDONLY, MPI_INFO_NULL, &file);
+    RunStats run_stats;
+    stats_start(&run_stats, opts.stats != NULL, opts.stats_interval);
 
-    MPI_Offset file_size;
-    MPI_File_get_size(file, &file_size);
-    file_size--;
+    WindowReader reader;
+    if (window_reader_open(&reader, opts.input) != 0)
+        MPI_Abort(MPI_COMM_WORLD, 1);
 
-    MPI_Offset chunk_start = rank * (file_size / size);
-    MPI_Offset chunk_end = (rank == size - 1) ? file_size : (rank + 1) * (file_size / size);
-    MPI_Offset chunk_size = chunk_end - chunk_start;
+    ChunkQueue queue;
 
-    // Read chunk
-    char *buffer = malloc(chunk_size + MAX_WORD_LEN); // buffer for overflow word
-    MPI_File_read_at(file, chunk_start, buffer, chunk_size, MPI_CHAR, MPI_STATUS_IGNORE);
-    buffer[chunk_size] = '\0';
+    // Allocate per-thread local tables
+    int num_threads = 2;
+    omp_set_num_threads(num_threads);
 
-    // Extend to read full word at the end
-    if (rank != size - 1)
+    if (opts.docs.mode != DOCS_NONE)
     {
-        int i = 0;
-        char c;
-        while (chunk_end + i < file_size && i < MAX_WORD_LEN - 1)
+        DocRows rows[2];
+        DocMatrixHeader h;
+        chunk_queue_init(&queue, reader.file_size, opts.dynamic);
+        for (int t = 0; t < num_threads; t++)
+            doc_rows_init(&rows[t], &opts.docs, opts.utf8);
+        count_documents(rows, num_threads, &opts, &reader, &queue);
+        window_reader_close(&reader);
+        chunk_queue_free(&queue);
+        int rc = doc_matrix_save_ranks(opts.matrix, rows, num_threads, &h);
+        for (int t = 0; t < num_threads; t++)
+            doc_rows_free(&rows[t]);
+        if (rank == 0 && rc == 0)
         {
-            MPI_File_read_at(file, chunk_end + i, &c, 1, MPI_CHAR, MPI_STATUS_IGNORE);
-            buffer[chunk_size + i] = c;
-            if (isspace(c))
-                break;
-            i++;
+            printf("Wrote %llu documents, %llu terms and %llu entries to %s\n", (unsigned long long)h.docs,
+                   (unsigned long long)h.terms, (unsigned long long)h.entries, opts.matrix);
+            printf("Hybrid MPI + OpenMP Document Count Completed in %.4f seconds\n", MPI_Wtime() - start_time);
         }
-        buffer[chunk_size + i + 1] = '\0';
+        stats_write_ranks(&run_stats, "hybrid", opts.stats);
+        MPI_Finalize();
+        return rc == 0 ? 0 : 1;
+    }
+    WordTable local_tables[2];
+    NgramCounter thread_ngrams[2];
+    NgramCounter ngrams;
+    Shuffle shuffle;
+    for (int t = 0; t < num_threads; t++)
+        word_table_init(&local_tables[t]);
+    if (opts.ngram == 1 && (opts.shuffle || opts.sort != SORT_NONE))
+        shuffle_init(&shuffle);
+    if (opts.ngram > 1)
+    {
+        ngram_counter_init(&ngrams, opts.ngram);
+        for (int t = 0; t < num_threads; t++)
+            ngram_counter_init(&thread_ngrams[t], opts.ngram);
     }
 
-    MPI_File_close(&file);
-
-    // Allocate per-thread local tables
-    int num_threads = 2;
-    omp_set_num_threads(num_threads);
-    Word *local_tables[2][HASH_SIZE] = {{0}};
+    // Resume from the last checkpoint, if there is one, and count only the
+    // ranges it does not cover
+    Checkpoint checkpoint = {0};
+    if (opts.checkpoint)
+    {
+        ByteRange *todo;
+        size_t ntodo;
+        if (checkpoint_begin(&checkpoint, opts.checkpoint, opts.checkpoint_interval, reader.file_size,
+                             &local_tables[0], &todo, &ntodo) != 0)
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        chunk_queue_init_ranges(&queue, reader.file_size, todo, ntodo, opts.dynamic);
+        free(todo);
+    }
+    else
+    {
+        chunk_queue_init(&queue, reader.file_size, opts.dynamic);
+    }
 
-// Parse and count words in parallel
-#pragma omp parallel
+    // Stream each range this rank is given through a fixed-size window; the
+    // threads split each window and count words in parallel. With --shuffle
+    // the window is counted one batch at a time, and each batch is sent to
+    // the owning ranks before the next one is parsed.
+    double count_start = MPI_Wtime();
+    MPI_Offset range_begin, range_end;
+    while (chunk_queue_next(&queue, &range_begin, &range_end))
     {
-        int tid = omp_get_thread_num();
-        Word **local_table = local_tables[tid];
+        if (opts.ngram > 1)
+            ngram_begin_part(&ngrams);
 
-        char word[MAX_WORD_LEN];
-        int j = 0;
-#pragma omp for
-        for (int i = 0; i < (int)strlen(buffer); i++)
+        Window w;
+        for (MPI_Offset pos = range_begin; window_read(&reader, pos, range_end, &w); pos += w.hi - w.lo)
         {
-            if (isalpha(buffer[i]))
+            size_t batch = opts.shuffle && opts.ngram == 1 ? SHUFFLE_BATCH : w.hi - w.lo;
+            for (size_t batch_lo = w.lo; batch_lo < w.hi; batch_lo += batch)
             {
-                if (j < MAX_WORD_LEN - 1)
-                    word[j++] = tolower(buffer[i]);
-            }
-            else
-            {
-                if (j > 0)
+                size_t batch_hi = w.hi - batch_lo > batch ? batch_lo + batch : w.hi;
+#pragma omp parallel
                 {
-                    word[j] = '\0';
-                    insert_word(local_table, word, 1);
-                    j = 0;
+                    int tid = omp_get_thread_num();
+                    int nthreads = omp_get_num_threads();
+                    size_t owned = batch_hi - batch_lo;
+                    size_t lo = batch_lo + owned * tid / nthreads;
+                    size_t hi = batch_lo + owned * (tid + 1) / nthreads;
+                    if (opts.ngram > 1)
+                    {
+                        ngram_begin_part(&thread_ngrams[tid]);
+                        scan_range(opts.utf8, reader.buf, w.len, lo, hi, ngram_emit, &thread_ngrams[tid]);
+                    }
+                    else
+                    {
+                        word_table_scan(&local_tables[tid], reader.buf, w.len, lo, hi, TOKEN_SPLIT_NONLETTER, opts.utf8);
+                    }
+                }
+
+                if (opts.shuffle && opts.ngram == 1)
+                {
+                    for (int t = 0; t < num_threads; t++)
+                        shuffle_flush(&shuffle, &local_tables[t]);
                 }
             }
-        }
-        if (j > 0)
-        {
-            word[j] = '\0';
-            insert_word(local_table, word, 1);
-        }
-    }
 
-    // Merge local thread tables
-    Word *merged_table[HASH_SIZE] = {0};
-    for (int t = 0; t < num_threads; t++)
-    {
-        for (int i = 0; i < HASH_SIZE; i++)
-        {
-            Word *entry = local_tables[t][i];
-            while (entry)
+            // Count the n-grams that straddle the seams between thread slices
+            if (opts.ngram > 1)
             {
-                insert_word(merged_table, entry->word, entry->count);
-                entry = entry->next;
+                for (int t = 0; t < num_threads; t++)
+                    ngram_stitch(&ngrams, &thread_ngrams[t]);
             }
+            checkpoint_done(&checkpoint, pos, pos + (MPI_Offset)(w.hi - w.lo));
+            checkpoint_maybe(&checkpoint, local_tables, num_threads);
         }
+
+        // An n-gram belongs to the rank holding its first word, so finish
+        // the ones that run past range_end
+        if (opts.ngram > 1)
+            scan_following_words(&reader, range_end, opts.ngram - 1, opts.utf8, ngram_emit, &ngrams);
     }
+    double count_seconds = MPI_Wtime() - count_start;
 
-    // Serialize merged table
-    int local_total = 0;
-    for (int i = 0; i < HASH_SIZE; i++)
+    if (opts.ngram > 1)
     {
-        Word *entry = merged_table[i];
-        while (entry)
+        for (int t = 0; t < num_threads; t++)
         {
-            local_total++;
-            entry = entry->next;
+            ngram_counter_merge(&ngrams, &thread_ngrams[t]);
+            ngram_counter_free(&thread_ngrams[t]);
         }
     }
 
-    char *flat_words = malloc(local_total * MAX_WORD_LEN);
-    int *counts = malloc(sizeof(int) * local_total);
-    int index = 0;
-    for (int i = 0; i < HASH_SIZE; i++)
+    // Deliver the last shuffle batches before any collective call. Sorted
+    // output without --shuffle sends the whole table here in one batch.
+    if (opts.ngram == 1 && (opts.shuffle || opts.sort != SORT_NONE))
     {
-        Word *entry = merged_table[i];
-        while (entry)
+        for (int t = 1; t < num_threads; t++)
+            shuffle_flush(&shuffle, &local_tables[t]);
+        shuffle_finish(&shuffle, &local_tables[0]);
+    }
+    window_reader_close(&reader);
+    chunk_queue_report(&queue, count_seconds);
+    chunk_queue_free(&queue);
+
+    if (opts.ngram > 1)
+    {
+        if (rank == 0)
+        {
+            for (int src = 1; src < size; src++)
+                recv_ngrams(&ngrams, src);
+
+            double end_time = MPI_Wtime();
+            save_results(NULL, &ngrams, "mpi_openmp_output.txt", end_time - start_time, opts.sort);
+            printf("Hybrid MPI + OpenMP %d-gram Count Completed in %.4f seconds\n", opts.ngram, end_time - start_time);
+        }
+        else
         {
-            strncpy(flat_words + index * MAX_WORD_LEN, entry->word, MAX_WORD_LEN);
-            counts[index] = entry->count;
-            index++;
-            entry = entry->next;
+            send_ngrams(&ngrams);
         }
+        ngram_counter_free(&ngrams);
+        stats_write_ranks(&run_stats, "hybrid", opts.stats);
+        MPI_Finalize();
+        return 0;
     }
 
-    if (rank == 0)
+    // Every rank ends up with the final counts of the words it owns and
+    // writes them as its shard of the output file, after a distributed sort
+    // if one was asked for
+    if (opts.shuffle || opts.sort != SORT_NONE)
     {
-        Word *global_table[HASH_SIZE] = {0};
-        for (int i = 0; i < local_total; i++)
+        for (int t = 0; t < num_threads; t++)
+            word_table_free(&local_tables[t]);
+        stats_add_table(&run_stats, "owned", &shuffle.owned);
+
+        char header[64] = "";
+        if (rank == 0)
+            snprintf(header, sizeof(header), "Execution Time: %.4f seconds\n\n", MPI_Wtime() - start_time);
+        int write_failed;
+        if (opts.sort != SORT_NONE)
         {
-            insert_word(global_table, flat_words + i * MAX_WORD_LEN, counts[i]);
+            write_failed = write_sorted_shards("mpi_openmp_output.txt", &shuffle.owned, opts.sort, header) != 0;
         }
+        else
+        {
+            char *text;
+            size_t text_len = format_table(&shuffle.owned, header, &text);
+            write_failed = write_shards("mpi_openmp_output.txt", text, text_len) != 0;
+            free(text);
+        }
+
+        printf("Rank %d owns %zu words, sent %lld batches (%lld bytes), received %lld batches (%lld bytes)\n",
+               rank, shuffle.owned.used, shuffle.batches_sent, shuffle.bytes_sent,
+               shuffle.batches_received, shuffle.bytes_received);
+        if (rank == 0)
+            printf("Hybrid MPI + OpenMP Word Count Completed in %.4f seconds\n", MPI_Wtime() - start_time);
+        shuffle_free(&shuffle);
+        // Keep the checkpoints if the results were not written, so a rerun
+        // can resume instead of counting again
+        if (!write_failed)
+            checkpoint_finish(&checkpoint);
+        stats_write_ranks(&run_stats, "hybrid", opts.stats);
+        MPI_Finalize();
+        return write_failed;
+    }
 
+    // Merge local thread tables
+    WordTable *merged_table = &local_tables[0];
+    for (int t = 0; t < num_threads; t++)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "thread %d", t);
+        stats_add_table(&run_stats, name, &local_tables[t]);
+    }
+    for (int t = 1; t < num_threads; t++)
+    {
+        word_table_merge(merged_table, &local_tables[t]);
+        word_table_free(&local_tables[t]);
+    }
+    stats_add_table(&run_stats, "local", merged_table);
+
+    if (rank == 0)
+    {
         for (int src = 1; src < size; src++)
         {
-            int recv_count;
-            MPI_Recv(&recv_count, 1, MPI_INT, src, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-            char *recv_words = malloc(recv_count * MAX_WORD_LEN);
-            int *recv_counts = malloc(sizeof(int) * recv_count);
-            MPI_Recv(recv_words, recv_count * MAX_WORD_LEN, MPI_CHAR, src, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-            MPI_Recv(recv_counts, recv_count, MPI_INT, src, 2, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-
-            for (int i = 0; i < recv_count; i++)
+            long long header[2];
+            MPI_Recv(header, 2, MPI_LONG_LONG, src, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            long long recv_count = header[0];
+            size_t recv_bytes = (size_t)header[1];
+
+            char *recv_words = malloc(recv_bytes ? recv_bytes : 1);
+            long long *recv_counts = malloc(recv_count ? recv_count * sizeof(long long) : 1);
+            recv_large(recv_words, recv_bytes, src, 1, MPI_COMM_WORLD);
+            recv_large(recv_counts, recv_count * sizeof(long long), src, 2, MPI_COMM_WORLD);
+
+            char *p = recv_words;
+            for (long long i = 0; i < recv_count; i++)
             {
-                insert_word(global_table, recv_words + i * MAX_WORD_LEN, recv_counts[i]);
+                word_table_add(merged_table, p, recv_counts[i]);
+                p += strlen(p) + 1;
             }
 
             free(recv_words);
             free(recv_counts);
         }
 
+        stats_add_table(&run_stats, "merged", merged_table);
         double end_time = MPI_Wtime();
-        save_results(global_table, "mpi_openmp_output.txt", end_time - start_time);
+        save_results(merged_table, NULL, "mpi_openmp_output.txt", end_time - start_time, SORT_NONE);
         printf("Hybrid MPI + OpenMP Word Count Completed in %.4f seconds\n", end_time - start_time);
     }
     else
     {
-        MPI_Send(&local_total, 1, MPI_INT, 0, 0, MPI_COMM_WORLD);
-        MPI_Send(flat_words, local_total * MAX_WORD_LEN, MPI_CHAR, 0, 1, MPI_COMM_WORLD);
-        MPI_Send(counts, local_total, MPI_INT, 0, 2, MPI_COMM_WORLD);
+        // Serialize merged table
+        char *flat_words;
+        size_t flat_bytes;
+        long long *counts;
+        long long local_total = flatten_table(merged_table, &flat_words, &flat_bytes, &counts);
+
+        long long header[2] = {local_total, (long long)flat_bytes};
+        MPI_Send(header, 2, MPI_LONG_LONG, 0, 0, MPI_COMM_WORLD);
+        send_large(flat_words, flat_bytes, 0, 1, MPI_COMM_WORLD);
+        send_large(counts, local_total * sizeof(long long), 0, 2, MPI_COMM_WORLD);
+
+        free(flat_words);
+        free(counts);
     }
+    word_table_free(merged_table);
+    checkpoint_finish(&checkpoint);
 
-    free(flat_words);
-    free(counts);
-    free(buffer);
-
+    stats_write_ranks(&run_stats, "hybrid", opts.stats);
     MPI_Finalize();
     return 0;
 }
@@ -1,65 +1,107 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
 #include <mpi.h>
 #include <unistd.h> // for getcwd()
 
 #define MAX_WORD_LEN 100
-#define HASH_SIZE 10007
-
-typedef struct Word {
-    char word[MAX_WORD_LEN];
-    int count;
-    struct Word *next;
-} Word;
-
-int hash(char *word) {
-    int h = 0;
-    for (int i = 0; word[i]; i++) {
-        h = (h * 31 + word[i]) % HASH_SIZE;
-    }
-    return h;
+#define OPTIONS_MPI
+
+#include "../common/checkpoint.h"
+#include "../common/chunk_queue.h"
+#include "../common/doc_matrix_mpi.h"
+#include "../common/options.h"
+#include "../common/sample_sort.h"
+#include "../common/shuffle.h"
+#include "../common/stats.h"
+#include "../common/window_io.h"
+#include "../common/word_table.h"
+
+// Ship an n-gram counter to rank 0: its vocab pool, then the n-grams as
+// packed ID tuples that rank 0 maps onto its own vocab.
+void send_ngrams(const NgramCounter *c) {
+    uint32_t *keys;
+    long long *counts;
+    long long entries = ngram_counter_flatten(c, &keys, &counts);
+    long long header[3] = {entries, c->vocab.count, (long long)c->vocab.pool_len};
+    MPI_Send(header, 3, MPI_LONG_LONG, 0, 0, MPI_COMM_WORLD);
+    send_large(c->vocab.pool, c->vocab.pool_len, 0, 1, MPI_COMM_WORLD);
+    send_large(keys, entries * c->table.n * sizeof(uint32_t), 0, 2, MPI_COMM_WORLD);
+    send_large(counts, entries * sizeof(long long), 0, 3, MPI_COMM_WORLD);
+    free(keys);
+    free(counts);
+}
+
+void recv_ngrams(NgramCounter *c, int src) {
+    long long header[3];
+    MPI_Recv(header, 3, MPI_LONG_LONG, src, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    long long entries = header[0];
+    size_t pool_len = (size_t)header[2];
+
+    char *pool = malloc(pool_len ? pool_len : 1);
+    uint32_t *keys = malloc(entries ? entries * c->table.n * sizeof(uint32_t) : 1);
+    long long *counts = malloc(entries ? entries * sizeof(long long) : 1);
+    recv_large(pool, pool_len, src, 1, MPI_COMM_WORLD);
+    recv_large(keys, entries * c->table.n * sizeof(uint32_t), src, 2, MPI_COMM_WORLD);
+    recv_large(counts, entries * sizeof(long long), src, 3, MPI_COMM_WORLD);
+
+    ngram_counter_merge_flat(c, pool, (uint32_t)header[1], keys, counts, entries);
+    free(pool);
+    free(keys);
+    free(counts);
 }
 
-void insert_word(Word **table, char *word, int count) {
-    int index = hash(word);
-    Word *entry = table[index];
-    while (entry) {
-        if (strcmp(entry->word, word) == 0) {
-            entry->count += count;
+// Count the documents of every range this rank is given into rows. A
+// document left open at the end of a range is read on to its separator. In
+// file mode the ranks take turns through the list of files instead.
+void count_documents(DocRows *rows, const Options *opts, WindowReader *reader, ChunkQueue *queue) {
+    if (opts->docs.mode == DOCS_FILE) {
+        int rank, size;
+        MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+        MPI_Comm_size(MPI_COMM_WORLD, &size);
+        char **paths;
+        size_t n;
+        if (doc_read_list(opts->input, &paths, &n) != 0)
             return;
-        }
-        entry = entry->next;
+        for (size_t i = rank; i < n; i += size)
+            doc_rows_add_file(rows, paths[i], i);
+        doc_free_list(paths, n);
+        return;
     }
-    Word *new_word = (Word *)malloc(sizeof(Word));
-    strcpy(new_word->word, word);
-    new_word->count = count;
-    new_word->next = table[index];
-    table[index] = new_word;
-}
 
-void clean_word(char *word) {
-    int j = 0;
-    for (int i = 0; word[i]; i++) {
-        if (isalpha(word[i]))
-            word[j++] = tolower(word[i]);
+    MPI_Offset range_begin, range_end;
+    while (chunk_queue_next(queue, &range_begin, &range_end)) {
+        doc_rows_begin_part(rows, range_begin, range_begin == 0);
+        Window w;
+        for (MPI_Offset pos = range_begin; window_read(reader, pos, range_end, &w); pos += w.hi - w.lo)
+            doc_rows_scan_window(rows, reader, &w, w.lo, w.hi, 0);
+        doc_rows_finish_range(rows, reader, range_end);
+        doc_rows_end_part(rows);
     }
-    word[j] = '\0';
 }
 
-void save_results(Word **table, const char *filename) {
+void save_results(const WordTable *table, const NgramCounter *ngrams, const char *filename, int sort) {
     FILE *f = fopen(filename, "w");
     if (!f) {
         fprintf(stderr, "Error: Could not open file %s for writing results.\n", filename);
         return;
     }
-    for (int i = 0; i < HASH_SIZE; i++) {
-        Word *entry = table[i];
-        while (entry) {
-            fprintf(f, "%s: %d\n", entry->word, entry->count);
-            entry = entry->next;
-        }
+    // N-grams sort as their "w1 w2" text
+    if (sort != SORT_NONE) {
+        WordTable text_table;
+        word_table_init(&text_table);
+        if (ngrams)
+            ngram_counter_to_table(ngrams, &text_table);
+        write_sorted_results(f, ngrams ? &text_table : table, sort);
+        word_table_free(&text_table);
+        fclose(f);
+        return;
+    }
+    if (ngrams)
+        ngram_write_results(f, ngrams);
+    for (size_t i = 0; table && i < table->used; i++) {
+        WordEntry *entry = word_table_entry(table, i);
+        fprintf(f, "%s: %lld\n", entry->word, entry->count);
     }
     fclose(f);
 }
@@ -83,141 +125,211 @@ int main(int argc, char *argv[]) {
 
     double start_time = MPI_Wtime();
 
-    if (argc < 2) {
-        if (rank == 0) printf("Usage: %s input.txt\n", argv[0]);
+    Options opts;
+    if (parse_options(argc, argv, &opts) != 0) {
+        if (rank == 0) printf("Usage: %s " OPTIONS_USAGE "\n", argv[0]);
         MPI_Finalize();
         return 1;
     }
 
-    MPI_File file;
-    MPI_Offset file_size;
-
-    MPI_File_open(MPI_COMM_WORLD, argv[1], MPI_MODE_RDONLY, MPI_INFO_NULL, &file);
-    MPI_File_get_size(file, &file_size);
-
-    MPI_Offset chunk_size = file_size / size;
-    MPI_Offset offset = rank * chunk_size;
-
-    // Each rank reads its chunk + MAX_WORD_LEN extra to avoid word truncation
-    char *buffer = malloc(chunk_size + MAX_WORD_LEN + 1);
-    MPI_File_read_at(file, offset, buffer, chunk_size + MAX_WORD_LEN, MPI_CHAR, MPI_STATUS_IGNORE);
-    buffer[chunk_size + MAX_WORD_LEN] = '\0';
-
-    MPI_File_close(&file);
-
-    // Tokenize words and count locally
-    Word *local_table[HASH_SIZE] = {0};
-    char temp[MAX_WORD_LEN];
-    int i = 0, j = 0;
-    while (buffer[i]) {
-        if (isalpha(buffer[i])) {
-            temp[j++] = tolower(buffer[i]);
-        } else if (j > 0) {
-            temp[j] = '\0';
-            insert_word(local_table, temp, 1);
-            j = 0;
-        }
-        i++;
-    }
-    if (j > 0) {
-        temp[j] = '\0';
-        insert_word(local_table, temp, 1);
-    }
-    free(buffer);
-
-    // Serialize local table
-    int local_count = 0;
-    for (int i = 0; i < HASH_SIZE; i++) {
-        Word *entry = local_table[i];
-        while (entry) {
-            local_count++;
-            entry = entry->next;
+    RunStats run_stats;
+    stats_start(&run_stats, opts.stats != NULL, opts.stats_interval);
+
+    WindowReader reader;
+    if (window_reader_open(&reader, opts.input) != 0)
+        MPI_Abort(MPI_COMM_WORLD, 1);
+
+    ChunkQueue queue;
+    if (opts.docs.mode != DOCS_NONE) {
+        chunk_queue_init(&queue, reader.file_size, opts.dynamic);
+        DocRows rows;
+        DocMatrixHeader h;
+        doc_rows_init(&rows, &opts.docs, opts.utf8);
+        count_documents(&rows, &opts, &reader, &queue);
+        window_reader_close(&reader);
+        chunk_queue_free(&queue);
+        int rc = doc_matrix_save_ranks(opts.matrix, &rows, 1, &h);
+        doc_rows_free(&rows);
+        if (rank == 0 && rc == 0) {
+            printf("Wrote %llu documents, %llu terms and %llu entries to %s\n", (unsigned long long)h.docs,
+                   (unsigned long long)h.terms, (unsigned long long)h.entries, opts.matrix);
+            printf("MPI Document Count Completed in %.4f seconds\n", MPI_Wtime() - start_time);
         }
+        stats_write_ranks(&run_stats, "mpi", opts.stats);
+        MPI_Finalize();
+        return rc == 0 ? 0 : 1;
     }
 
-    char *flat_words = malloc(local_count * MAX_WORD_LEN);
-    int *flat_counts = malloc(local_count * sizeof(int));
-
-    int index = 0;
-    for (int i = 0; i < HASH_SIZE; i++) {
-        Word *entry = local_table[i];
-        while (entry) {
-            strncpy(flat_words + index * MAX_WORD_LEN, entry->word, MAX_WORD_LEN);
-            flat_counts[index] = entry->count;
-            index++;
-            entry = entry->next;
-        }
+    // Stream each range this rank is given through a fixed-size window and
+    // count locally
+    WordTable local_table;
+    NgramCounter ngrams;
+    Shuffle shuffle;
+    word_table_init(&local_table);
+    if (opts.ngram > 1)
+        ngram_counter_init(&ngrams, opts.ngram);
+    else if (opts.shuffle || opts.sort != SORT_NONE)
+        shuffle_init(&shuffle);
+
+    // Resume from the last checkpoint, if there is one, and count only the
+    // ranges it does not cover
+    Checkpoint checkpoint = {0};
+    if (opts.checkpoint) {
+        ByteRange *todo;
+        size_t ntodo;
+        if (checkpoint_begin(&checkpoint, opts.checkpoint, opts.checkpoint_interval, reader.file_size, &local_table,
+                             &todo, &ntodo) != 0)
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        chunk_queue_init_ranges(&queue, reader.file_size, todo, ntodo, opts.dynamic);
+        free(todo);
+    } else {
+        chunk_queue_init(&queue, reader.file_size, opts.dynamic);
     }
 
-    // Gather word counts
-    int *recv_counts = NULL, *displs = NULL;
-    int *word_recvcounts = NULL, *word_displs = NULL;
-    int total_recv = 0;
+    double count_start = MPI_Wtime();
+    MPI_Offset range_begin, range_end;
+    while (chunk_queue_next(&queue, &range_begin, &range_end)) {
+        if (opts.ngram > 1)
+            ngram_begin_part(&ngrams);
+
+        Window w;
+        for (MPI_Offset pos = range_begin; window_read(&reader, pos, range_end, &w); pos += w.hi - w.lo) {
+            if (opts.ngram > 1) {
+                scan_range(opts.utf8, reader.buf, w.len, w.lo, w.hi, ngram_emit, &ngrams);
+            } else if (opts.shuffle) {
+                // Ship each batch to the owning ranks before parsing the next
+                for (size_t lo = w.lo; lo < w.hi; lo += SHUFFLE_BATCH) {
+                    size_t hi = w.hi - lo > SHUFFLE_BATCH ? lo + SHUFFLE_BATCH : w.hi;
+                    word_table_scan(&local_table, reader.buf, w.len, lo, hi, TOKEN_SPLIT_NONLETTER, opts.utf8);
+                    shuffle_flush(&shuffle, &local_table);
+                }
+            } else {
+                word_table_scan(&local_table, reader.buf, w.len, w.lo, w.hi, TOKEN_SPLIT_NONLETTER, opts.utf8);
+            }
+            checkpoint_done(&checkpoint, pos, pos + (MPI_Offset)(w.hi - w.lo));
+            checkpoint_maybe(&checkpoint, &local_table, 1);
+        }
 
-    if (rank == 0) {
-        recv_counts = malloc(size * sizeof(int));
+        // An n-gram belongs to the rank holding its first word, so finish the
+        // ones that run past range_end
+        if (opts.ngram > 1)
+            scan_following_words(&reader, range_end, opts.ngram - 1, opts.utf8, ngram_emit, &ngrams);
     }
-
-    MPI_Gather(&local_count, 1, MPI_INT, recv_counts, 1, MPI_INT, 0, MPI_COMM_WORLD);
-
-    char *all_words = NULL;
-    int *all_counts = NULL;
-
-    if (rank == 0) {
-        word_recvcounts = malloc(size * sizeof(int));
-        word_displs = malloc(size * sizeof(int));
-        displs = malloc(size * sizeof(int));
-
-        displs[0] = 0;
-        word_recvcounts[0] = recv_counts[0] * MAX_WORD_LEN;
-        word_displs[0] = 0;
-        total_recv = recv_counts[0];
-
-        for (int i = 1; i < size; i++) {
-            displs[i] = displs[i - 1] + recv_counts[i - 1];
-            word_recvcounts[i] = recv_counts[i] * MAX_WORD_LEN;
-            word_displs[i] = word_displs[i - 1] + word_recvcounts[i - 1];
-            total_recv += recv_counts[i];
+    double count_seconds = MPI_Wtime() - count_start;
+
+    // Deliver the last shuffle batches before any collective call. Sorted
+    // output without --shuffle sends the whole table here in one batch.
+    if (opts.ngram == 1 && (opts.shuffle || opts.sort != SORT_NONE))
+        shuffle_finish(&shuffle, &local_table);
+    window_reader_close(&reader);
+    chunk_queue_report(&queue, count_seconds);
+    chunk_queue_free(&queue);
+
+    if (opts.ngram > 1) {
+        if (rank == 0) {
+            for (int src = 1; src < size; src++)
+                recv_ngrams(&ngrams, src);
+
+            save_results(NULL, &ngrams, "mpi_output_p4.txt", opts.sort);
+
+            double elapsed = MPI_Wtime() - start_time;
+            printf("MPI %d-gram Count Completed in %.4f seconds\n", opts.ngram, elapsed);
+            save_execution_time(elapsed, "mpi_execution_time_p4.txt");
+        } else {
+            send_ngrams(&ngrams);
         }
-
-        all_words = malloc(total_recv * MAX_WORD_LEN);
-        all_counts = malloc(total_recv * sizeof(int));
+        ngram_counter_free(&ngrams);
+        stats_write_ranks(&run_stats, "mpi", opts.stats);
+        MPI_Finalize();
+        return 0;
     }
 
-    MPI_Gatherv(flat_words, local_count * MAX_WORD_LEN, MPI_CHAR,
-                all_words, word_recvcounts, word_displs, MPI_CHAR,
-                0, MPI_COMM_WORLD);
+    // Every rank ends up with the final counts of the words it owns and
+    // writes them as its shard of the output file, after a distributed sort
+    // if one was asked for
+    if (opts.shuffle || opts.sort != SORT_NONE) {
+        stats_add_table(&run_stats, "owned", &shuffle.owned);
+        int write_failed;
+        if (opts.sort != SORT_NONE) {
+            write_failed = write_sorted_shards("mpi_output_p4.txt", &shuffle.owned, opts.sort, NULL) != 0;
+        } else {
+            char *text;
+            size_t text_len = format_table(&shuffle.owned, NULL, &text);
+            write_failed = write_shards("mpi_output_p4.txt", text, text_len) != 0;
+            free(text);
+        }
 
-    MPI_Gatherv(flat_counts, local_count, MPI_INT,
-                all_counts, recv_counts, displs, MPI_INT,
-                0, MPI_COMM_WORLD);
+        printf("Rank %d owns %zu words, sent %lld batches (%lld bytes), received %lld batches (%lld bytes)\n",
+               rank, shuffle.owned.used, shuffle.batches_sent, shuffle.bytes_sent,
+               shuffle.batches_received, shuffle.bytes_received);
+        if (rank == 0) {
+            double elapsed = MPI_Wtime() - start_time;
+            printf("MPI Word Count Completed in %.4f seconds\n", elapsed);
+            save_execution_time(elapsed, "mpi_execution_time_p4.txt");
+        }
+        shuffle_free(&shuffle);
+        word_table_free(&local_table);
+        // Keep the checkpoints if the results were not written, so a rerun
+        // can resume instead of counting again
+        if (!write_failed)
+            checkpoint_finish(&checkpoint);
+        stats_write_ranks(&run_stats, "mpi", opts.stats);
+        MPI_Finalize();
+        return write_failed;
+    }
 
+    // Rank 0 merges one rank at a time into its own table, so no buffer
+    // ever holds every rank's table
+    stats_add_table(&run_stats, "local", &local_table);
     if (rank == 0) {
-        Word *global_table[HASH_SIZE] = {0};
-
-        for (int i = 0; i < total_recv; i++) {
-            insert_word(global_table, all_words + i * MAX_WORD_LEN, all_counts[i]);
+        for (int src = 1; src < size; src++) {
+            long long header[2];
+            MPI_Recv(header, 2, MPI_LONG_LONG, src, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            long long recv_count = header[0];
+            size_t recv_bytes = (size_t)header[1];
+
+            char *recv_words = malloc(recv_bytes ? recv_bytes : 1);
+            long long *recv_counts = malloc(recv_count ? recv_count * sizeof(long long) : 1);
+            recv_large(recv_words, recv_bytes, src, 1, MPI_COMM_WORLD);
+            recv_large(recv_counts, recv_count * sizeof(long long), src, 2, MPI_COMM_WORLD);
+
+            char *p = recv_words;
+            for (long long i = 0; i < recv_count; i++) {
+                word_table_add(&local_table, p, recv_counts[i]);
+                p += strlen(p) + 1;
+            }
+
+            free(recv_words);
+            free(recv_counts);
         }
 
-        save_results(global_table, "mpi_output_p4.txt");
+        stats_add_table(&run_stats, "merged", &local_table);
+        save_results(&local_table, NULL, "mpi_output_p4.txt", SORT_NONE);
 
         double end_time = MPI_Wtime();
         double elapsed = end_time - start_time;
         printf("MPI Word Count Completed in %.4f seconds\n", elapsed);
 
         save_execution_time(elapsed, "mpi_execution_time_p4.txt");
-
-        free(recv_counts);
-        free(displs);
-        free(word_recvcounts);
-        free(word_displs);
-        free(all_words);
-        free(all_counts);
+    } else {
+        // Serialize local table
+        char *flat_words;
+        size_t flat_bytes;
+        long long *flat_counts;
+        long long local_count = flatten_table(&local_table, &flat_words, &flat_bytes, &flat_counts);
+
+        long long header[2] = {local_count, (long long)flat_bytes};
+        MPI_Send(header, 2, MPI_LONG_LONG, 0, 0, MPI_COMM_WORLD);
+        send_large(flat_words, flat_bytes, 0, 1, MPI_COMM_WORLD);
+        send_large(flat_counts, local_count * sizeof(long long), 0, 2, MPI_COMM_WORLD);
+
+        free(flat_words);
+        free(flat_counts);
     }
+    word_table_free(&local_table);
+    checkpoint_finish(&checkpoint);
 
-    free(flat_words);
-    free(flat_counts);
-
+    stats_write_ranks(&run_stats, "mpi", opts.stats);
     MPI_Finalize();
     return 0;
 }
@@ -5,150 +5,169 @@
 #include <omp.h>
 
 #define MAX_WORD_LEN 100
-#define HASH_SIZE 10007
-#define MAX_WORDS 10000000
 #define MAX_THREADS 16
 
-typedef struct Word {
-    char word[MAX_WORD_LEN];
-    int count;
-    struct Word *next;
-} Word;
-
-Word* global_hash_table[HASH_SIZE];
-Word* thread_local_tables[MAX_THREADS][HASH_SIZE];
-
-// Hash function
-int hash(char *word) {
-    int h = 0;
-    for (int i = 0; word[i]; i++)
-        h = (h * 31 + word[i]) % HASH_SIZE;
-    return h;
-}
-
-// Insert into thread local hash table
-void insert_word_local(Word **table, char *word) {
-    int index = hash(word);
-    Word *entry = table[index];
-
-    while (entry) {
-        if (strcmp(entry->word, word) == 0) {
-            entry->count++;
-            return;
-        }
-        entry = entry->next;
-    }
-
-    Word *new_word = (Word *)malloc(sizeof(Word));
-    strcpy(new_word->word, word);
-    new_word->count = 1;
-    new_word->next = table[index];
-    table[index] = new_word;
-}
-
-// Merge one threads hash table into global hash table
-void merge_local_to_global(Word **local) {
-    for (int i = 0; i < HASH_SIZE; i++) {
-        Word *entry = local[i];
-        while (entry) {
-            Word *next = entry->next;
-
-            int index = hash(entry->word);
-            Word *g_entry = global_hash_table[index];
-            int found = 0;
-            while (g_entry) {
-                if (strcmp(g_entry->word, entry->word) == 0) {
-                    g_entry->count += entry->count;
-                    found = 1;
-                    break;
-                }
-                g_entry = g_entry->next;
-            }
-
-            if (!found) {
-                Word *new_word = (Word *)malloc(sizeof(Word));
-                strcpy(new_word->word, entry->word);
-                new_word->count = entry->count;
-                new_word->next = global_hash_table[index];
-                global_hash_table[index] = new_word;
-            }
-
-            free(entry);
-            entry = next;
-        }
-    }
-}
-
-// Lowercase, remove punctuation
-void clean_word(char *word) {
-    int j = 0;
-    for (int i = 0; word[i]; i++) {
-        if (isalpha(word[i])) {
-            word[j++] = tolower(word[i]);
-        }
+#include "../common/doc_matrix.h"
+#include "../common/file_map.h"
+#include "../common/options.h"
+#include "../common/stats.h"
+#include "../common/word_table.h"
+
+WordTable global_table;
+WordTable thread_local_tables[MAX_THREADS];
+NgramCounter global_ngrams;
+NgramTable thread_ngram_tables[MAX_THREADS];
+
+// Word IDs in input order, for n-gram counting
+typedef struct {
+    Vocab *vocab;
+    uint32_t *ids;
+    size_t count, cap;
+} WordIds;
+
+void push_word_id(void *ctx, char *word) {
+    WordIds *w = ctx;
+    if (w->count == w->cap) {
+        w->cap = w->cap ? 2 * w->cap : 1 << 16;
+        w->ids = realloc(w->ids, w->cap * sizeof(uint32_t));
     }
-    word[j] = '\0';
+    w->ids[w->count++] = vocab_intern(w->vocab, word);
 }
 
-// Load all words into array
-int load_words(char *filename, char words[][MAX_WORD_LEN]) {
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        perror("File open failed");
+// Load all words as IDs interned in vocab, split as in unigram mode
+int load_word_ids(const char *filename, WordIds *w, int utf8) {
+    const char *data;
+    size_t size;
+    if (map_input(filename, &data, &size) != 0)
         return -1;
-    }
+    scan_space_tokens(utf8, data, size, push_word_id, w);
+    unmap_input(data, size);
+    return 0;
+}
 
-    int count = 0;
-    char buffer[MAX_WORD_LEN];
-    while (fscanf(file, "%s", buffer) != EOF && count < MAX_WORDS) {
-        clean_word(buffer);
-        if (strlen(buffer) > 0) {
-            strcpy(words[count++], buffer);
+// Count documents into one row buffer per thread and write the
+// term-document matrix. Each thread owns the documents that start in its
+// slice of the file, and reads on past the slice to finish the last one.
+int count_documents(const Options *opts, int num_threads) {
+    DocRows *rows = malloc(num_threads * sizeof(DocRows));
+    for (int t = 0; t < num_threads; t++)
+        doc_rows_init(&rows[t], &opts->docs, opts->utf8);
+
+    int rc = -1;
+    if (opts->docs.mode == DOCS_FILE) {
+        char **paths;
+        size_t n;
+        if (doc_read_list(opts->input, &paths, &n) != 0)
+            goto cleanup;
+        #pragma omp parallel for schedule(dynamic)
+        for (size_t i = 0; i < n; i++)
+            doc_rows_add_file(&rows[omp_get_thread_num()], paths[i], i);
+        doc_free_list(paths, n);
+    } else {
+        const char *data;
+        size_t size;
+        if (map_input(opts->input, &data, &size) != 0)
+            goto cleanup;
+        #pragma omp parallel
+        {
+            int tid = omp_get_thread_num();
+            int nthreads = omp_get_num_threads();
+            size_t lo = size * tid / nthreads;
+            size_t hi = size * (tid + 1) / nthreads;
+            if (lo < hi) {
+                doc_rows_begin_part(&rows[tid], lo, lo == 0);
+                doc_rows_scan(&rows[tid], data, size, lo, hi, 1, 0);
+                doc_rows_scan(&rows[tid], data, size, hi, size, 1, 1);
+                doc_rows_end_part(&rows[tid]);
+            }
         }
+        unmap_input(data, size);
     }
 
-    fclose(file);
-    return count;
+    DocMatrixHeader h;
+    rc = doc_matrix_save(opts->matrix, rows, num_threads, &h);
+    if (rc == 0)
+        printf("Wrote %llu documents, %llu terms and %llu entries to %s\n", (unsigned long long)h.docs,
+               (unsigned long long)h.terms, (unsigned long long)h.entries, opts->matrix);
+
+cleanup:
+    for (int t = 0; t < num_threads; t++)
+        doc_rows_free(&rows[t]);
+    free(rows);
+    return rc;
 }
 
 // Save final global hash table
-void save_results() {
+void save_results(int ngram, int sort) {
     FILE *fp = fopen("word_counts_Thread4.txt", "w");
     if (!fp) {
         perror("Failed to open output file");
         return;
     }
 
-    for (int i = 0; i < HASH_SIZE; i++) {
-        Word *entry = global_hash_table[i];
-        while (entry) {
-            fprintf(fp, "%s: %d\n", entry->word, entry->count);
-            entry = entry->next;
-        }
+    // Sorted output goes through the word table, so n-grams sort like words.
+    // The merge sort runs as OpenMP tasks.
+    if (sort != SORT_NONE) {
+        if (ngram > 1)
+            ngram_counter_to_table(&global_ngrams, &global_table);
+        write_sorted_results(fp, &global_table, sort);
+        fclose(fp);
+        return;
+    }
+
+    if (ngram > 1)
+        ngram_write_results(fp, &global_ngrams);
+
+    for (size_t i = 0; i < global_table.used; i++) {
+        WordEntry *entry = word_table_entry(&global_table, i);
+        fprintf(fp, "%s: %lld\n", entry->word, entry->count);
     }
 
     fclose(fp);
 }
 
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        printf("Usage: %s input.txt\n", argv[0]);
+    Options opts;
+    if (parse_options(argc, argv, &opts) != 0) {
+        printf("Usage: %s " OPTIONS_USAGE "\n", argv[0]);
         return 1;
     }
 
     int num_threads = 4;
     omp_set_num_threads(num_threads);
+    RunStats run_stats;
+    stats_start(&run_stats, opts.stats != NULL, opts.stats_interval);
+
+    if (opts.docs.mode != DOCS_NONE) {
+        double start = omp_get_wtime();
+        if (count_documents(&opts, num_threads) != 0)
+            return 1;
+        printf("Document count complete. Time taken: %.4f seconds with %d threads\n", omp_get_wtime() - start,
+               num_threads);
+        stats_write(&run_stats, "openmp", opts.stats);
+        return 0;
+    }
 
-    char (*words)[MAX_WORD_LEN] = malloc(sizeof(char[MAX_WORD_LEN]) * MAX_WORDS);
-    if (!words) {
-        printf("Memory allocation failed\n");
+    // Single words are scanned straight from the mapped file; n-gram mode
+    // keeps one 4-byte ID per word
+    const char *data = NULL;
+    size_t size = 0;
+    WordIds words = {0};
+    long long total_words = 0;
+    int ngram = opts.ngram;
+
+    word_table_init(&global_table);
+    if (ngram > 1) {
+        ngram_counter_init(&global_ngrams, ngram);
+        words.vocab = &global_ngrams.vocab;
+        if (load_word_ids(opts.input, &words, opts.utf8) != 0)
+            return 1;
+        total_words = (long long)words.count;
+    } else if (map_input(opts.input, &data, &size) != 0) {
         return 1;
     }
 
-    int total_words = load_words(argv[1], words);
-    if (total_words < 0) return 1;
-
-    int *word_counts = calloc(num_threads, sizeof(int));
+    long long *word_counts = calloc(num_threads, sizeof(long long));
     double *thread_times = calloc(num_threads, sizeof(double));
 
     double start_time = omp_get_wtime();
@@ -156,14 +175,28 @@ int main(int argc, char *argv[]) {
     #pragma omp parallel
     {
         int tid = omp_get_thread_num();
-        Word **local_table = thread_local_tables[tid];
+        int nthreads = omp_get_num_threads();
 
         double local_start = omp_get_wtime();
 
-        #pragma omp for
-        for (int i = 0; i < total_words; i++) {
-            insert_word_local(local_table, words[i]);
-            word_counts[tid]++;
+        if (ngram > 1) {
+            // Every n-gram starting at i lies in the shared ID array, so
+            // splitting the start positions among threads needs no stitching
+            NgramTable *local_ngrams = &thread_ngram_tables[tid];
+            ngram_table_init(local_ngrams, ngram);
+
+            #pragma omp for
+            for (long long i = 0; i < total_words - ngram + 1; i++) {
+                ngram_table_add(local_ngrams, words.ids + i, 1);
+                word_counts[tid]++;
+            }
+        } else {
+            // Each thread owns the words that start in its slice of the file
+            WordTable *local_table = &thread_local_tables[tid];
+            word_table_init(local_table);
+            size_t lo = size * tid / nthreads;
+            size_t hi = size * (tid + 1) / nthreads;
+            word_counts[tid] = word_table_scan(local_table, data, size, lo, hi, TOKEN_SPLIT_SPACE, opts.utf8);
         }
 
         double local_end = omp_get_wtime();
@@ -172,7 +205,16 @@ int main(int argc, char *argv[]) {
 
     // Merging thread-local tables into global table
     for (int t = 0; t < num_threads; t++) {
-        merge_local_to_global(thread_local_tables[t]);
+        if (ngram > 1) {
+            ngram_table_merge(&global_ngrams.table, &thread_ngram_tables[t]);
+            ngram_table_free(&thread_ngram_tables[t]);
+        } else {
+            char name[32];
+            snprintf(name, sizeof(name), "thread %d", t);
+            stats_add_table(&run_stats, name, &thread_local_tables[t]);
+            word_table_merge(&global_table, &thread_local_tables[t]);
+            word_table_free(&thread_local_tables[t]);
+        }
     }
 
     double end_time = omp_get_wtime();
@@ -181,10 +223,13 @@ int main(int argc, char *argv[]) {
 
     printf("Word count complete. Time taken: %.4f seconds with %d threads\n\n", duration, num_threads);
     for (int i = 0; i < num_threads; i++) {
-        printf("Thread %d processed %d words in %.4f seconds\n", i, word_counts[i], thread_times[i]);
+        printf("Thread %d processed %lld words in %.4f seconds\n", i, word_counts[i], thread_times[i]);
     }
 
-    save_results();
+    if (ngram == 1)
+        stats_add_table(&run_stats, "global", &global_table);
+    save_results(ngram, opts.sort);
+    stats_write(&run_stats, "openmp", opts.stats);
 
     // Log thread performance
     FILE *log = fopen("performance_log_thread4.txt", "w");
@@ -192,7 +237,7 @@ int main(int argc, char *argv[]) {
         fprintf(log, "Execution time: %.4f seconds\n", duration);
         fprintf(log, "Threads used: %d\n\n", num_threads);
         for (int i = 0; i < num_threads; i++) {
-            fprintf(log, "Thread %d processed %d words in %.4f seconds\n",
+            fprintf(log, "Thread %d processed %lld words in %.4f seconds\n",
                     i, word_counts[i], thread_times[i]);
         }
         fclose(log);
@@ -200,7 +245,8 @@ int main(int argc, char *argv[]) {
         perror("Failed to open performance log file");
     }
 
-    free(words);
+    unmap_input(data, size);
+    free(words.ids);
     free(word_counts);
     free(thread_times);
 
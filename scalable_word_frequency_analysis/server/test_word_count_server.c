@@ -0,0 +1,115 @@
+// Checks for the query server, run against a real results file:
+//   gcc -pthread -o test_word_count_server test_word_count_server.c
+//   ./test_word_count_server ../hybrid/mpi_openmp_output.txt
+#define WORD_COUNT_SERVER_NO_MAIN
+#include "word_count_server.c"
+
+int failures;
+
+#define CHECK(cond)                                                   \
+    do {                                                              \
+        if (!(cond)) {                                                \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,    \
+                    __LINE__, #cond);                                 \
+            failures++;                                               \
+        }                                                             \
+    } while (0)
+
+// Count the "word: count" lines of a results file and sum their counts,
+// without going through load_snapshot()
+void count_result_lines(const char *path, size_t *words, long long *total) {
+    FILE *f = fopen(path, "r");
+    char line[4096];
+    *words = 0;
+    *total = 0;
+    while (f && fgets(line, sizeof(line), f)) {
+        char *sep = strrchr(line, ':');
+        long long count;
+        char rest;
+        if (sep && sscanf(sep + 1, " %lld %c", &count, &rest) == 1) {
+            (*words)++;
+            *total += count;
+        }
+    }
+    if (f)
+        fclose(f);
+}
+
+// The Hybrid output starts with "Execution Time: 0.0098 seconds", which
+// must not load as a word
+void test_hybrid_output(const char *path) {
+    Snapshot *s = load_snapshot(path);
+    CHECK(s != NULL);
+    if (!s)
+        return;
+
+    size_t words;
+    long long total;
+    count_result_lines(path, &words, &total);
+    CHECK(words > 0);
+    CHECK(s->table.used == words);
+    CHECK(s->total == total);
+
+    const char *header = "Execution Time";
+    CHECK(word_table_find(&s->table, header, strlen(header), word_hash(header, strlen(header))) < 0);
+
+    Reply r = {malloc(4096), 0, 4096};
+    char args[] = "E 1000";
+    handle_prefix(s, args, &r);
+    CHECK(r.len >= 5 && strncmp(r.data, "OK 0\n", 5) == 0);
+    free(r.data);
+    free_snapshot(s);
+}
+
+// An oversized request gets exactly one error; the request after it is
+// answered normally
+void test_request_too_long(const char *path) {
+    current = load_snapshot(path);
+    CHECK(current != NULL);
+    if (!current)
+        return;
+
+    int fds[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    pthread_t thread;
+    pthread_create(&thread, NULL, serve_client, (void *)(intptr_t)fds[1]);
+
+    size_t len = 3 * MAX_REQUEST_LEN;
+    char *request = malloc(len + 16);
+    memset(request, 'a', len);
+    memcpy(request + len, "\nSTATS\n", 8);
+    CHECK(write_all(fds[0], request, len + 8) == 0);
+    shutdown(fds[0], SHUT_WR);
+
+    char reply[4096];
+    size_t have = 0;
+    ssize_t n;
+    while ((n = read(fds[0], reply + have, sizeof(reply) - 1 - have)) > 0)
+        have += n;
+    reply[have] = '\0';
+    pthread_join(thread, NULL);
+    close(fds[0]);
+
+    char expected[256];
+    snprintf(expected, sizeof(expected), "ERR request too long\nOK 1\nwords %zu total %lld generation %lu\n",
+             current->table.used, current->total, current->generation);
+    CHECK(strcmp(reply, expected) == 0);
+
+    free(request);
+    free_snapshot(current);
+    current = NULL;
+}
+
+int main(int argc, char *argv[]) {
+    const char *hybrid_output = argc > 1 ? argv[1] : "../hybrid/mpi_openmp_output.txt";
+
+    test_hybrid_output(hybrid_output);
+    test_request_too_long(hybrid_output);
+
+    if (failures) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("All server checks passed\n");
+    return 0;
+}
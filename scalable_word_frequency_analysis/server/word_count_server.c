@@ -0,0 +1,409 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define MAX_WORD_LEN 100
+#define MAX_REQUEST_LEN 65536
+#define POLL_INTERVAL_MS 1000
+#define DEFAULT_LIMIT 10
+
+#include "../common/word_table.h"
+
+// A finished count table, immutable once built. Lookups go through the
+// hash table; prefix and top-K queries use the two sorted views.
+typedef struct {
+    WordTable table;
+    WordEntry **by_word;
+    WordEntry **by_count;
+    long long total;
+    unsigned long generation;
+    struct stat source;
+} Snapshot;
+
+const char *results_path;
+const char *socket_path;
+Snapshot *current;
+unsigned long generation;
+pthread_rwlock_t snapshot_lock;
+volatile sig_atomic_t reload_requested;
+volatile sig_atomic_t stopping;
+
+int compare_by_word(const void *a, const void *b) {
+    return strcmp((*(WordEntry *const *)a)->word, (*(WordEntry *const *)b)->word);
+}
+
+// Count descending, then alphabetical, so equal counts come back in a fixed order
+int compare_by_count(const void *a, const void *b) {
+    const WordEntry *x = *(WordEntry *const *)a, *y = *(WordEntry *const *)b;
+    if (x->count != y->count)
+        return x->count < y->count ? 1 : -1;
+    return strcmp(x->word, y->word);
+}
+
+void free_snapshot(Snapshot *s) {
+    if (!s)
+        return;
+    word_table_free(&s->table);
+    free(s->by_word);
+    free(s->by_count);
+    free(s);
+}
+
+// Parse "word: count" lines as written by every implementation. The word is
+// everything before the last ": ", so n-gram results load too. A line whose
+// count is not a whole integer up to the end of the line (such as the Hybrid
+// "Execution Time: 0.0098 seconds" header) is skipped.
+Snapshot *load_snapshot(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Could not open results file: %s\n", path);
+        return NULL;
+    }
+
+    Snapshot *s = calloc(1, sizeof(Snapshot));
+    word_table_init(&s->table);
+    fstat(fileno(f), &s->source);
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t n;
+    while ((n = getline(&line, &cap, f)) > 0) {
+        char *sep = NULL;
+        for (char *p = strstr(line, ": "); p; p = strstr(p + 1, ": "))
+            sep = p;
+        if (!sep || sep == line)
+            continue;
+        char *end;
+        long long count = strtoll(sep + 2, &end, 10);
+        if (end == sep + 2)
+            continue;
+        while (isspace((unsigned char)*end))
+            end++;
+        if (*end != '\0')
+            continue;
+        *sep = '\0';
+        word_table_add(&s->table, line, count);
+        s->total += count;
+    }
+    free(line);
+    fclose(f);
+
+    size_t words = s->table.used;
+    s->by_word = malloc((words ? words : 1) * sizeof(WordEntry *));
+    s->by_count = malloc((words ? words : 1) * sizeof(WordEntry *));
+    for (size_t i = 0; i < words; i++)
+        s->by_word[i] = s->by_count[i] = word_table_entry(&s->table, i);
+    qsort(s->by_word, words, sizeof(WordEntry *), compare_by_word);
+    qsort(s->by_count, words, sizeof(WordEntry *), compare_by_count);
+    return s;
+}
+
+// Build the new snapshot off to the side, then swap it in under the write
+// lock, so a request always sees either the old table or the new one.
+int reload(void) {
+    Snapshot *s = load_snapshot(results_path);
+    if (!s)
+        return -1;
+
+    pthread_rwlock_wrlock(&snapshot_lock);
+    Snapshot *old = current;
+    s->generation = ++generation;
+    current = s;
+    pthread_rwlock_unlock(&snapshot_lock);
+
+    free_snapshot(old);
+    printf("Loaded %zu words from %s (generation %lu)\n", s->table.used, results_path, s->generation);
+    fflush(stdout);
+    return 0;
+}
+
+int source_changed(const struct stat *old) {
+    struct stat st;
+    if (stat(results_path, &st) != 0)
+        return 0;
+    return st.st_ino != old->st_ino || st.st_size != old->st_size ||
+           st.st_mtim.tv_sec != old->st_mtim.tv_sec || st.st_mtim.tv_nsec != old->st_mtim.tv_nsec;
+}
+
+// Reload when the results file is replaced (publish with write + rename)
+// or on SIGHUP.
+void *watch_results(void *arg) {
+    (void)arg;
+    while (!stopping) {
+        usleep(POLL_INTERVAL_MS * 1000);
+
+        pthread_rwlock_rdlock(&snapshot_lock);
+        struct stat seen = current->source;
+        pthread_rwlock_unlock(&snapshot_lock);
+
+        if (reload_requested || source_changed(&seen)) {
+            reload_requested = 0;
+            reload();
+        }
+    }
+    return NULL;
+}
+
+typedef struct {
+    char *data;
+    size_t len, cap;
+} Reply;
+
+void reply_printf(Reply *r, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+void reply_printf(Reply *r, const char *fmt, ...) {
+    va_list ap;
+    for (;;) {
+        va_start(ap, fmt);
+        int n = vsnprintf(r->data + r->len, r->cap - r->len, fmt, ap);
+        va_end(ap);
+        if (n >= 0 && r->len + n < r->cap) {
+            r->len += n;
+            return;
+        }
+        r->cap = r->cap * 2 + n;
+        r->data = realloc(r->data, r->cap);
+    }
+}
+
+long long lookup(const Snapshot *s, const char *word) {
+    uint32_t len = (uint32_t)strlen(word);
+    long long index = word_table_find(&s->table, word, len, word_hash(word, len));
+    return index < 0 ? 0 : word_table_entry(&s->table, index)->count;
+}
+
+// GET w1 w2 ...  -> one "word count" line per key, 0 when absent. Keys are
+// split on tabs if the request has any (for n-gram keys), else on spaces.
+void handle_get(const Snapshot *s, char *args, Reply *r) {
+    const char *delims = strchr(args, '\t') ? "\t" : " ";
+    char *keys[MAX_REQUEST_LEN / 2];
+    int n = 0;
+    for (char *save, *k = strtok_r(args, delims, &save); k; k = strtok_r(NULL, delims, &save))
+        keys[n++] = k;
+
+    reply_printf(r, "OK %d\n", n);
+    for (int i = 0; i < n; i++)
+        reply_printf(r, "%s %lld\n", keys[i], lookup(s, keys[i]));
+}
+
+// PREFIX p [limit]  -> words starting with p, alphabetically
+void handle_prefix(const Snapshot *s, char *args, Reply *r) {
+    char *save;
+    char *prefix = strtok_r(args, " ", &save);
+    char *limit_arg = prefix ? strtok_r(NULL, " ", &save) : NULL;
+    long limit = limit_arg ? atol(limit_arg) : DEFAULT_LIMIT;
+    if (!prefix)
+        prefix = "";
+    size_t plen = strlen(prefix);
+
+    size_t lo = 0, hi = s->table.used;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (strcmp(s->by_word[mid]->word, prefix) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    size_t end = lo;
+    while (end < s->table.used && (long)(end - lo) < limit && strncmp(s->by_word[end]->word, prefix, plen) == 0)
+        end++;
+
+    reply_printf(r, "OK %zu\n", end - lo);
+    for (size_t i = lo; i < end; i++)
+        reply_printf(r, "%s %lld\n", s->by_word[i]->word, s->by_word[i]->count);
+}
+
+// TOP k  -> the k most frequent words
+void handle_top(const Snapshot *s, char *args, Reply *r) {
+    long k = *args ? atol(args) : DEFAULT_LIMIT;
+    size_t n = k < 0 ? 0 : (size_t)k;
+    if (n > s->table.used)
+        n = s->table.used;
+    reply_printf(r, "OK %zu\n", n);
+    for (size_t i = 0; i < n; i++)
+        reply_printf(r, "%s %lld\n", s->by_count[i]->word, s->by_count[i]->count);
+}
+
+void handle_request(char *line, Reply *r) {
+    char *args = strchr(line, ' ');
+    if (args)
+        *args++ = '\0';
+    else
+        args = line + strlen(line);
+
+    if (strcmp(line, "RELOAD") == 0) {
+        if (reload() == 0)
+            reply_printf(r, "OK 0\n");
+        else
+            reply_printf(r, "ERR reload failed\n");
+        return;
+    }
+
+    pthread_rwlock_rdlock(&snapshot_lock);
+    const Snapshot *s = current;
+    if (strcmp(line, "GET") == 0)
+        handle_get(s, args, r);
+    else if (strcmp(line, "PREFIX") == 0)
+        handle_prefix(s, args, r);
+    else if (strcmp(line, "TOP") == 0)
+        handle_top(s, args, r);
+    else if (strcmp(line, "STATS") == 0)
+        reply_printf(r, "OK 1\nwords %zu total %lld generation %lu\n", s->table.used, s->total, s->generation);
+    else
+        reply_printf(r, "ERR unknown command %s\n", line);
+    pthread_rwlock_unlock(&snapshot_lock);
+}
+
+int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// One thread per client. Requests are newline-terminated; every request in
+// a read is answered with a single write. A request longer than
+// MAX_REQUEST_LEN gets one error, and the rest of it is dropped up to its
+// newline.
+void *serve_client(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    char *buf = malloc(MAX_REQUEST_LEN + 1);
+    size_t have = 0;
+    int discarding = 0;
+    Reply r = {malloc(4096), 0, 4096};
+
+    for (;;) {
+        ssize_t n = read(fd, buf + have, MAX_REQUEST_LEN - have);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            break;
+        }
+        have += n;
+
+        r.len = 0;
+        char *start = buf;
+        char *nl;
+        if (discarding) {
+            nl = memchr(buf, '\n', have);
+            if (!nl) {
+                have = 0;
+                continue;
+            }
+            start = nl + 1;
+            discarding = 0;
+        }
+        while ((nl = memchr(start, '\n', buf + have - start))) {
+            *nl = '\0';
+            if (nl > start && nl[-1] == '\r')
+                nl[-1] = '\0';
+            handle_request(start, &r);
+            start = nl + 1;
+        }
+        have -= start - buf;
+        memmove(buf, start, have);
+        if (have == MAX_REQUEST_LEN) {
+            reply_printf(&r, "ERR request too long\n");
+            have = 0;
+            discarding = 1;
+        }
+        if (r.len && write_all(fd, r.data, r.len) != 0)
+            break;
+    }
+
+    close(fd);
+    free(buf);
+    free(r.data);
+    return NULL;
+}
+
+void on_signal(int sig) {
+    if (sig == SIGHUP)
+        reload_requested = 1;
+    else
+        stopping = 1;
+}
+
+// The tests include this file and bring their own main
+#ifndef WORD_COUNT_SERVER_NO_MAIN
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        printf("Usage: %s results.txt socket_path\n", argv[0]);
+        return 1;
+    }
+    results_path = argv[1];
+    socket_path = argv[2];
+
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&snapshot_lock, &attr);
+
+    if (reload() != 0)
+        return 1;
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path);
+    if (server < 0 || bind(server, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(server, 128) != 0) {
+        perror("Failed to listen on socket");
+        return 1;
+    }
+
+    struct sigaction sa = {.sa_handler = on_signal};
+    sigaction(SIGHUP, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t watcher;
+    pthread_create(&watcher, NULL, watch_results, NULL);
+
+    printf("Serving %s on %s\n", results_path, socket_path);
+    fflush(stdout);
+
+    while (!stopping) {
+        int client = accept(server, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("accept failed");
+            break;
+        }
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serve_client, (void *)(intptr_t)client) != 0) {
+            close(client);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    close(server);
+    unlink(socket_path);
+    pthread_join(watcher, NULL);
+    return 0;
+}
+#endif
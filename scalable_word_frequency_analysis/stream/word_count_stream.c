@@ -0,0 +1,629 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_WORD_LEN 100
+#ifndef STREAM_BLOCK
+#define STREAM_BLOCK (1 << 20)
+#endif
+#define FLUSH_MS 50         // longest a partial block waits for more input
+#define MAX_INFLIGHT 64     // blocks read but not yet merged; the reader waits beyond this
+#define MAX_PANES 1024
+#define MAX_SEGMENTS 16     // slide boundaries one block may cross
+#define DEFAULT_TOP 10
+#define DEFAULT_THREADS 4
+#define DEFAULT_INTERVAL 1.0
+
+#include "../common/sort.h"
+#include "../common/word_table.h"
+
+// Continuous counting over stdin or a FIFO. A reader thread cuts the input
+// into line-aligned blocks, worker threads scan each block into its own
+// table, and the main thread merges finished blocks in input order and
+// prints the window's top words at a fixed interval.
+//
+// A window of W lines or seconds sliding by S is kept as W / S panes, each
+// with its own table, plus one running total over all of them. When a pane
+// slides out of the window its counts are subtracted from the total and its
+// table is freed, so expiry costs one pass over that pane's distinct words
+// rather than a recount of the window. A tumbling window is one pane.
+
+enum {
+    WINDOW_ALL,         // everything since the start
+    WINDOW_LINES,
+    WINDOW_SECONDS,
+};
+
+typedef struct {
+    int kind;
+    double size;        // in lines or seconds
+    double slide;
+    int panes;          // size / slide
+} WindowSpec;
+
+// A block of input, then the worker's counts for it: one table per pane the
+// block's lines fall into.
+typedef struct Block {
+    long long seq;
+    char *data;
+    size_t len;
+    long long first_line;
+    long long lines;
+    long long time_pane;        // pane the block arrived in, for time windows
+    int nsegments;
+    long long *segment_pane;
+    long long *segment_lines;
+    long long *segment_words;
+    WordTable *segment_table;
+    struct Block *next;
+} Block;
+
+typedef struct {
+    long long id;       // -1 when the slot holds no pane
+    WordTable table;
+    long long words;
+    long long lines;
+} Pane;
+
+WindowSpec window;
+int utf8;
+int input_fd;
+struct timespec start_time;
+
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t work_ready = PTHREAD_COND_INITIALIZER;
+pthread_cond_t done_ready = PTHREAD_COND_INITIALIZER;
+pthread_cond_t space_ready = PTHREAD_COND_INITIALIZER;
+Block *work_head, *work_tail;
+Block *done[MAX_INFLIGHT];      // scanned blocks by seq % MAX_INFLIGHT
+int inflight;
+int input_done;
+long long blocks_read;
+volatile sig_atomic_t stopping;
+
+// Window state, owned by the main thread
+Pane panes[MAX_PANES];
+long long current_pane;
+WordTable total;
+long long window_words, window_lines;
+long long bytes_seen, lines_seen, words_seen, late_words;
+
+double elapsed(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start_time.tv_sec) + (now.tv_nsec - start_time.tv_nsec) / 1e9;
+}
+
+// "N" is N lines and "Ns" is N seconds.
+int parse_extent(const char *s, double *value, int *kind) {
+    char *end;
+    *value = strtod(s, &end);
+    if (end == s || *value <= 0)
+        return -1;
+    if (strcmp(end, "s") == 0) {
+        *kind = WINDOW_SECONDS;
+        return 0;
+    }
+    if (*end || *value != (long long)*value)
+        return -1;
+    *kind = WINDOW_LINES;
+    return 0;
+}
+
+int parse_window(const char *size, const char *slide, WindowSpec *w) {
+    if (!size) {
+        w->kind = WINDOW_ALL;
+        w->panes = 1;
+        return slide ? -1 : 0;
+    }
+    int slide_kind;
+    if (parse_extent(size, &w->size, &w->kind) != 0)
+        return -1;
+    w->slide = w->size;
+    slide_kind = w->kind;
+    if (slide && parse_extent(slide, &w->slide, &slide_kind) != 0)
+        return -1;
+    if (slide_kind != w->kind) {
+        fprintf(stderr, "--window and --slide must both be lines or both be seconds\n");
+        return -1;
+    }
+    double panes = w->size / w->slide;
+    if (panes < 1 || panes > MAX_PANES || panes != (int)panes ||
+        (w->kind == WINDOW_SECONDS && w->slide < 0.01)) {
+        fprintf(stderr, "--window must be a multiple of --slide, at most %d slides, "
+                        "and a time slide at least 0.01s\n", MAX_PANES);
+        return -1;
+    }
+    w->panes = (int)panes;
+    return 0;
+}
+
+// Reader
+
+// Read into buf[have, cap). Returns once the buffer is full, at end of
+// input, or FLUSH_MS after the first unsent byte arrived.
+size_t fill_block(char *buf, size_t have, size_t cap, int *eof) {
+    double deadline = have ? elapsed() + FLUSH_MS / 1000.0 : -1;
+    while (have < cap && !stopping) {
+        // Idle waits are bounded too, so a signal to another thread is noticed
+        int timeout = FLUSH_MS;
+        if (deadline >= 0) {
+            timeout = (int)((deadline - elapsed()) * 1000);
+            if (timeout <= 0)
+                break;
+        }
+        struct pollfd p = {.fd = input_fd, .events = POLLIN};
+        int r = poll(&p, 1, timeout);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll failed");
+            *eof = 1;
+            break;
+        }
+        if (r == 0)
+            break;
+        ssize_t n = read(input_fd, buf + have, cap - have);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            perror("Failed to read input");
+            *eof = 1;
+            break;
+        }
+        if (n == 0) {
+            *eof = 1;
+            break;
+        }
+        if (have == 0)
+            deadline = elapsed() + FLUSH_MS / 1000.0;
+        have += n;
+    }
+    if (stopping)
+        *eof = 1;
+    return have;
+}
+
+// Offset just past the n-th newline of buf, or len if there are fewer.
+size_t skip_lines(const char *buf, size_t len, long long n, long long *found) {
+    size_t pos = 0;
+    *found = 0;
+    while (*found < n) {
+        const char *nl = memchr(buf + pos, '\n', len - pos);
+        if (!nl)
+            return len;
+        pos = nl - buf + 1;
+        (*found)++;
+    }
+    return pos;
+}
+
+// Where to cut a full block that holds no newline: just past the last ASCII
+// byte that is not a letter. Such a byte ends a word in both tokenizer modes
+// and is never part of a UTF-8 sequence, so no word is split. Only a single
+// word longer than the block is cut, at the last character boundary.
+size_t word_boundary(const char *buf, size_t len) {
+    const unsigned char *s = (const unsigned char *)buf;
+    for (size_t i = len; i > 0; i--) {
+        if (s[i - 1] < 0x80 && !ascii_letter_fold[s[i - 1]])
+            return i;
+    }
+    size_t i = len - 1;
+    while (i > 0 && (s[i] & 0xC0) == 0x80)
+        i--;
+    return i > 0 ? i : len;
+}
+
+long long count_lines(const char *buf, size_t len) {
+    long long n = 0;
+    const char *p = buf, *end = buf + len;
+    while ((p = memchr(p, '\n', end - p))) {
+        n++;
+        p++;
+    }
+    return n;
+}
+
+void submit(Block *b) {
+    pthread_mutex_lock(&lock);
+    while (inflight == MAX_INFLIGHT)
+        pthread_cond_wait(&space_ready, &lock);
+    b->seq = blocks_read++;
+    inflight++;
+    if (work_tail)
+        work_tail->next = b;
+    else
+        work_head = b;
+    work_tail = b;
+    pthread_cond_signal(&work_ready);
+    pthread_mutex_unlock(&lock);
+}
+
+// Hand out whole lines. A trailing partial line waits for its newline unless
+// the block is full or the input has ended; a full block without a newline
+// is cut between words.
+void *read_input(void *arg) {
+    (void)arg;
+    char *buf = malloc(STREAM_BLOCK);
+    size_t have = 0;
+    long long line = 0;
+    int eof = 0;
+    while (!eof || have) {
+        have = fill_block(buf, have, STREAM_BLOCK, &eof);
+        size_t cut = have;
+        if (!eof) {
+            const char *nl = memrchr(buf, '\n', have);
+            if (nl)
+                cut = nl - buf + 1;
+            else if (have < STREAM_BLOCK)
+                continue;
+            else
+                cut = word_boundary(buf, have);
+        }
+        if (cut == 0)
+            continue;
+        // Every pane a block touches costs the worker a table, so a line
+        // window with a short slide gets shorter blocks
+        if (window.kind == WINDOW_LINES) {
+            long long slide = (long long)window.slide, found;
+            long long limit = (line / slide + MAX_SEGMENTS) * slide - line;
+            size_t end = skip_lines(buf, cut, limit, &found);
+            if (found == limit)
+                cut = end;
+        }
+
+        Block *b = calloc(1, sizeof(Block));
+        b->data = buf;
+        b->len = cut;
+        b->first_line = line;
+        b->lines = count_lines(buf, cut);
+        if (window.kind == WINDOW_SECONDS)
+            b->time_pane = (long long)(elapsed() / window.slide);
+        line += b->lines;
+
+        buf = malloc(STREAM_BLOCK);
+        have -= cut;
+        memcpy(buf, b->data + cut, have);
+        submit(b);
+    }
+    free(buf);
+
+    pthread_mutex_lock(&lock);
+    input_done = 1;
+    pthread_cond_broadcast(&work_ready);
+    pthread_cond_broadcast(&done_ready);
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+// Workers
+
+void add_segment(Block *b, long long pane, size_t lo, size_t hi, long long lines) {
+    int i = b->nsegments++;
+    b->segment_pane = realloc(b->segment_pane, b->nsegments * sizeof(long long));
+    b->segment_lines = realloc(b->segment_lines, b->nsegments * sizeof(long long));
+    b->segment_words = realloc(b->segment_words, b->nsegments * sizeof(long long));
+    b->segment_table = realloc(b->segment_table, b->nsegments * sizeof(WordTable));
+    b->segment_pane[i] = pane;
+    b->segment_lines[i] = lines;
+    word_table_init(&b->segment_table[i]);
+    b->segment_words[i] = word_table_scan(&b->segment_table[i], b->data, b->len, lo, hi, TOKEN_SPLIT_NONLETTER, utf8);
+}
+
+// Count a block, one table per pane. Line windows split the block where the
+// line number crosses a slide boundary; otherwise the block is one segment.
+void count_block(Block *b) {
+    if (window.kind != WINDOW_LINES) {
+        add_segment(b, window.kind == WINDOW_SECONDS ? b->time_pane : 0, 0, b->len, b->lines);
+        return;
+    }
+    long long slide = (long long)window.slide;
+    long long line = b->first_line;
+    size_t pos = 0;
+    while (pos < b->len) {
+        long long pane = line / slide;
+        long long got;
+        size_t end = pos + skip_lines(b->data + pos, b->len - pos, (pane + 1) * slide - line, &got);
+        add_segment(b, pane, pos, end, got);
+        line += got;
+        pos = end;
+    }
+}
+
+void *count_blocks(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        while (!work_head && !input_done)
+            pthread_cond_wait(&work_ready, &lock);
+        Block *b = work_head;
+        if (b) {
+            work_head = b->next;
+            if (!work_head)
+                work_tail = NULL;
+        }
+        pthread_mutex_unlock(&lock);
+        if (!b)
+            break;
+
+        count_block(b);
+        free(b->data);
+        b->data = NULL;
+
+        pthread_mutex_lock(&lock);
+        done[b->seq % MAX_INFLIGHT] = b;
+        pthread_cond_signal(&done_ready);
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+// Window
+
+// Rebuild the total from the live panes once expired words, left behind
+// at count zero, outnumber the live ones.
+void compact_total(void) {
+    size_t live = 0;
+    for (int i = 0; i < window.panes; i++)
+        if (panes[i].id >= 0)
+            live += panes[i].table.used;
+    if (total.used <= 2 * live + 65536)
+        return;
+    WordTable fresh;
+    word_table_init(&fresh);
+    for (int i = 0; i < window.panes; i++)
+        if (panes[i].id >= 0)
+            word_table_merge(&fresh, &panes[i].table);
+    word_table_free(&total);
+    total = fresh;
+}
+
+void expire_pane(Pane *p) {
+    for (size_t s = 0; s < p->table.cap; s++) {
+        uint64_t slot = p->table.slots[s];
+        if (!slot)
+            continue;
+        const WordEntry *e = word_table_entry(&p->table, (uint32_t)slot - 1);
+        word_table_add_hashed(&total, e->word, e->len, slot >> 32, -e->count);
+    }
+    window_words -= p->words;
+    window_lines -= p->lines;
+    word_table_free(&p->table);
+    word_table_init(&p->table);
+    p->id = -1;
+    p->words = p->lines = 0;
+}
+
+// Make pane the newest one, expiring every pane that slides out.
+void advance_window(long long pane) {
+    if (window.kind == WINDOW_ALL || pane <= current_pane)
+        return;
+    int expired = 0;
+    for (int i = 0; i < window.panes; i++) {
+        if (panes[i].id >= 0 && panes[i].id <= pane - window.panes) {
+            expire_pane(&panes[i]);
+            expired = 1;
+        }
+    }
+    current_pane = pane;
+    if (expired)
+        compact_total();
+}
+
+void merge_block(Block *b) {
+    bytes_seen += b->len;
+    lines_seen += b->lines;
+    for (int i = 0; i < b->nsegments; i++) {
+        long long id = b->segment_pane[i];
+        WordTable *t = &b->segment_table[i];
+        words_seen += b->segment_words[i];
+        advance_window(id);
+        if (window.kind != WINDOW_ALL && id <= current_pane - window.panes) {
+            // Arrived after its time pane had already left the window
+            late_words += b->segment_words[i];
+        } else {
+            if (window.kind != WINDOW_ALL) {
+                Pane *p = &panes[id % window.panes];
+                p->id = id;
+                word_table_merge(&p->table, t);
+                p->words += b->segment_words[i];
+                p->lines += b->segment_lines[i];
+            }
+            word_table_merge(&total, t);
+            window_words += b->segment_words[i];
+            window_lines += b->segment_lines[i];
+        }
+        word_table_free(t);
+    }
+    free(b->segment_pane);
+    free(b->segment_lines);
+    free(b->segment_words);
+    free(b->segment_table);
+    free(b);
+}
+
+// Snapshots
+
+void sift_down(WordEntry **heap, size_t n, size_t i) {
+    for (;;) {
+        size_t worst = i, l = 2 * i + 1, r = l + 1;
+        if (l < n && compare_entries(heap[l], heap[worst], SORT_COUNT) > 0)
+            worst = l;
+        if (r < n && compare_entries(heap[r], heap[worst], SORT_COUNT) > 0)
+            worst = r;
+        if (worst == i)
+            return;
+        WordEntry *tmp = heap[i];
+        heap[i] = heap[worst];
+        heap[worst] = tmp;
+        i = worst;
+    }
+}
+
+// Print the window's top words, keeping the best k in a heap whose root is
+// the weakest of them. Words below min_share percent of the window are left
+// out, so a share threshold turns top-K into a heavy-hitter report.
+void print_snapshot(long long n, int k, double min_share) {
+    WordEntry **heap = malloc((k ? k : 1) * sizeof(WordEntry *));
+    size_t size = 0, distinct = 0;
+    for (size_t i = 0; i < total.used; i++) {
+        WordEntry *e = word_table_entry(&total, i);
+        if (e->count <= 0)
+            continue;
+        distinct++;
+        if (size < (size_t)k) {
+            heap[size++] = e;
+            if (size == (size_t)k)
+                for (size_t j = size / 2; j-- > 0;)
+                    sift_down(heap, size, j);
+        } else if (k && compare_entries(e, heap[0], SORT_COUNT) < 0) {
+            heap[0] = e;
+            sift_down(heap, size, 0);
+        }
+    }
+    qsort(heap, size, sizeof(WordEntry *), compare_count_qsort);
+
+    double t = elapsed();
+    printf("--- snapshot %lld at %.3fs: %lld lines, %lld words, %zu distinct in window; %.1f MB/s\n", n, t,
+           window_lines, window_words, distinct, t > 0 ? bytes_seen / t / 1e6 : 0.0);
+    for (size_t i = 0; i < size; i++) {
+        double share = window_words ? 100.0 * heap[i]->count / window_words : 0;
+        if (share < min_share)
+            break;
+        printf("%s: %lld (%.2f%%)\n", heap[i]->word, heap[i]->count, share);
+    }
+    fflush(stdout);
+    free(heap);
+}
+
+void on_signal(int sig) {
+    (void)sig;
+    stopping = 1;
+}
+
+int main(int argc, char *argv[]) {
+    const char *input = NULL, *size = NULL, *slide = NULL;
+    int top = DEFAULT_TOP, threads = DEFAULT_THREADS, bad = 0;
+    double interval = DEFAULT_INTERVAL, min_share = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--window") == 0 && i + 1 < argc)
+            size = argv[++i];
+        else if (strcmp(argv[i], "--slide") == 0 && i + 1 < argc)
+            slide = argv[++i];
+        else if (strcmp(argv[i], "--top") == 0 && i + 1 < argc)
+            bad |= (top = atoi(argv[++i])) < 1;
+        else if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc)
+            bad |= (interval = atof(argv[++i])) < 0.01;
+        else if (strcmp(argv[i], "--min-share") == 0 && i + 1 < argc)
+            bad |= (min_share = atof(argv[++i])) < 0;
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            bad |= (threads = atoi(argv[++i])) < 1;
+        else if (strcmp(argv[i], "--utf8") == 0)
+            utf8 = 1;
+        else if (!input && (argv[i][0] != '-' || strcmp(argv[i], "-") == 0))
+            input = argv[i];
+        else
+            bad = 1;
+    }
+    if (bad || parse_window(size, slide, &window) != 0) {
+        printf("Usage: %s [FILE|-] [--window N|Ns] [--slide N|Ns] [--top K] [--interval SECONDS]\n"
+               "       [--min-share PCT] [--threads N] [--utf8]\n", argv[0]);
+        return 1;
+    }
+
+    input_fd = STDIN_FILENO;
+    if (input && strcmp(input, "-") != 0 && (input_fd = open(input, O_RDONLY)) < 0) {
+        perror("File open failed");
+        return 1;
+    }
+
+    struct sigaction sa = {.sa_handler = on_signal};
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    word_table_init(&total);
+    for (int i = 0; i < window.panes; i++) {
+        panes[i].id = -1;
+        word_table_init(&panes[i].table);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    pthread_t reader;
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+    pthread_create(&reader, NULL, read_input, NULL);
+    for (int i = 0; i < threads; i++)
+        pthread_create(&workers[i], NULL, count_blocks, NULL);
+
+    // Merge blocks in input order; wake for every snapshot even when the
+    // input is idle, so time windows keep sliding.
+    long long next = 0, snapshots = 0;
+    double next_snapshot = interval;
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        Block *b;
+        while (!(b = done[next % MAX_INFLIGHT]) && !(input_done && next == blocks_read)) {
+            double wait = next_snapshot - elapsed();
+            if (wait <= 0)
+                break;
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec += (time_t)wait;
+            until.tv_nsec += (long)((wait - (time_t)wait) * 1e9);
+            if (until.tv_nsec >= 1000000000L) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&done_ready, &lock, &until);
+        }
+        int finished = !b && input_done && next == blocks_read;
+        if (b)
+            done[next % MAX_INFLIGHT] = NULL;
+        pthread_mutex_unlock(&lock);
+
+        if (b) {
+            merge_block(b);
+            next++;
+            pthread_mutex_lock(&lock);
+            inflight--;
+            pthread_cond_signal(&space_ready);
+            pthread_mutex_unlock(&lock);
+        }
+
+        double now = elapsed();
+        if (window.kind == WINDOW_SECONDS && !finished)
+            advance_window((long long)(now / window.slide));
+        if (now >= next_snapshot || finished) {
+            print_snapshot(++snapshots, top, min_share);
+            while (next_snapshot <= now)
+                next_snapshot += interval;
+        }
+        if (finished)
+            break;
+    }
+
+    pthread_join(reader, NULL);
+    for (int i = 0; i < threads; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+
+    double duration = elapsed();
+    printf("Stream ended after %.3f seconds: %lld bytes, %lld lines, %lld words (%.1f MB/s)\n", duration,
+           bytes_seen, lines_seen, words_seen, duration > 0 ? bytes_seen / duration / 1e6 : 0.0);
+    if (late_words)
+        printf("Dropped %lld words that arrived after their window had passed\n", late_words);
+
+    if (input_fd != STDIN_FILENO)
+        close(input_fd);
+    for (int i = 0; i < window.panes; i++)
+        word_table_free(&panes[i].table);
+    word_table_free(&total);
+    return 0;
+}